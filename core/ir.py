@@ -0,0 +1,191 @@
+from core.parser import BuiltinTypes, is_string
+
+TYPE_NAMES = {
+    BuiltinTypes.UInt: "uint",
+    BuiltinTypes.Char: "char",
+    BuiltinTypes.InlineString: "str",
+}
+
+# Instructions that only compute their destination and can be dropped when it's unused
+PURE_OPS = {"const", "addr", "load", "loadb", "second", "mov", "add", "sub", "mul", "not",
+            "eq", "lt", "gt", "le", "ge"}
+TERMINATORS = {"jmp", "br", "switch", "ret"}
+
+class VReg:
+    def __init__(self, id, type):
+        self.id = id
+        self.type = BuiltinTypes(type)
+
+    def __str__(self):
+        return f"%{self.id}:{TYPE_NAMES[self.type]}"
+
+    def __repr__(self):
+        return str(self)
+
+class StringValue:
+    """A string on the simulated stack: the registers holding its pointer and its length."""
+    def __init__(self, ptr, length):
+        self.ptr = ptr
+        self.length = length
+
+    @property
+    def type(self):
+        return self.ptr.type
+
+    def __str__(self):
+        return f"({self.ptr}, {self.length})"
+
+class Instr:
+    """
+    A single IR instruction. `args` holds the virtual registers read by the
+    instruction, everything else (immediates, labels, call targets, branch
+    targets) lives in named attributes. `second` reads the rest of a
+    two-word call result, and has to come right after the call defining
+    its argument.
+    """
+    def __init__(self, op, dst=None, args=None, **attrs):
+        self.op = op
+        self.dst = dst
+        self.args = list(args or [])
+        self.imm = attrs.get("imm")
+        self.label = attrs.get("label")
+        self.offset = attrs.get("offset", 0)
+        self.func = attrs.get("func")
+        self.targets = list(attrs.get("targets", []))
+        # Table size in bits of a strhash
+        self.bits = attrs.get("bits")
+
+    def is_pure(self):
+        return self.op in PURE_OPS
+
+    def __str__(self):
+        parts = [str(a) for a in self.args]
+        if self.imm is not None:
+            parts.append(str(self.imm))
+        if self.label is not None:
+            parts.append(f"[{self.label}{self.offset:+}]" if self.offset else f"[{self.label}]")
+        if self.func is not None:
+            parts.insert(0, self.func)
+        if self.bits is not None:
+            parts.append(f"width={self.offset}, bits={self.bits}")
+        parts += [t.label for t in self.targets]
+        text = f"{self.op} " + ", ".join(parts) if parts else self.op
+        return f"{self.dst} = {text}" if self.dst else text
+
+class Block:
+    def __init__(self, label):
+        self.label = label
+        self.instrs = []
+
+    @property
+    def terminator(self):
+        if self.instrs and self.instrs[-1].op in TERMINATORS:
+            return self.instrs[-1]
+        return None
+
+    def successors(self):
+        term = self.terminator
+        return term.targets if term else []
+
+class Function:
+    def __init__(self, name):
+        self.name = name
+        self.blocks = []
+        self.vreg_count = 0
+        # Initial value of every variable whose storage doesn't start out zeroed
+        self.initial_values = {}
+
+    def new_vreg(self, type):
+        self.vreg_count += 1
+        return VReg(self.vreg_count, type)
+
+    def instr_count(self):
+        return sum(len(b.instrs) for b in self.blocks)
+
+    def dump(self):
+        lines = [f"function {self.name}:"]
+        for block in self.blocks:
+            lines.append(f"{block.label}:")
+            lines += [f"    {i}" for i in block.instrs]
+        return lines
+
+class IRBuilder:
+    """
+    Lowers the stack machine into virtual registers. The Sweet stack is
+    simulated at compile time; at block boundaries every live stack entry
+    is copied into a canonical per-depth register so that all predecessors
+    of a block agree on where the stack lives.
+    """
+    def __init__(self, ctx, name="sweet_main"):
+        self.ctx = ctx
+        self.fn = Function(name)
+        self.stack = []
+        self.slots = {}
+        self.block = self.new_block()
+
+    def new_block(self):
+        block = Block(self.ctx.new_label())
+        self.fn.blocks.append(block)
+        return block
+
+    def emit(self, op, type=None, args=None, **attrs):
+        dst = self.fn.new_vreg(type) if type is not None else None
+        self.block.instrs.append(Instr(op, dst, args, **attrs))
+        return dst
+
+    def push(self, vreg):
+        self.stack.append(vreg)
+
+    def pop(self, what="IR lowering"):
+        if not self.stack:
+            raise Exception(f"Stack underflow in {what}")
+        return self.stack.pop()
+
+    def push_string(self, ptr, length):
+        self.stack.append(StringValue(ptr, length))
+
+    def truth(self, value):
+        """The register a branch on value tests: a string is true when it isn't empty."""
+        return value.length if is_string(value.type) else value
+
+    def slot(self, depth, part, type):
+        key = (depth, part, BuiltinTypes(type))
+        if key not in self.slots:
+            self.slots[key] = self.fn.new_vreg(type)
+        return self.slots[key]
+
+    def to_slot(self, depth, part, value):
+        slot = self.slot(depth, part, value.type)
+        if value is not slot:
+            self.block.instrs.append(Instr("mov", slot, [value]))
+        return slot
+
+    def canonicalize(self):
+        """Copy the simulated stack into the canonical slot registers and return the new stack state."""
+        for depth in reversed(range(len(self.stack))):
+            value = self.stack[depth]
+            if isinstance(value, StringValue):
+                self.stack[depth] = StringValue(self.to_slot(depth, 0, value.ptr), self.to_slot(depth, 1, value.length))
+            else:
+                self.stack[depth] = self.to_slot(depth, 0, value)
+        return list(self.stack)
+
+    def jump(self, target):
+        self.block.instrs.append(Instr("jmp", targets=[target]))
+
+    def branch(self, cond, if_true, if_false):
+        self.block.instrs.append(Instr("br", args=[cond], targets=[if_true, if_false]))
+
+    def switch(self, index, targets):
+        """Jump to targets[index]; index has to be in range."""
+        self.block.instrs.append(Instr("switch", args=[index], targets=targets))
+
+    def start_block(self, block, state):
+        self.block = block
+        self.stack = list(state)
+
+    def lower(self, ast):
+        for stmt in ast:
+            stmt.lower(self)
+        self.block.instrs.append(Instr("ret"))
+        return self.fn
@@ -11,6 +11,10 @@ class TokenType(Enum):
     KEYWORD = auto()
     IDENTIFIER = auto()
     BANG = auto()
+    LESS = auto()
+    GREATER = auto()
+    LESS_EQUAL = auto()
+    GREATER_EQUAL = auto()
     LBRACK = auto()
     RBRACK = auto()
     EOF = auto()
@@ -22,10 +26,18 @@ token_map = {
     "/": TokenType.SLASH,
     "?": TokenType.COMPARE,
     "!": TokenType.BANG,
+    "<": TokenType.LESS,
+    ">": TokenType.GREATER,
     "[": TokenType.LBRACK,
     "]": TokenType.RBRACK,
 }
 
+# Two character operators, matched before the single character ones
+compound_token_map = {
+    "<=": TokenType.LESS_EQUAL,
+    ">=": TokenType.GREATER_EQUAL,
+}
+
 keywords = {"if", "else", "end", "dup", "print", "input", "extern", "var", "set", "loop", "do", "as"}
 
 class Token:
@@ -105,6 +117,12 @@ class Lexer:
             if self.current_char.isdigit():
                 return self.number()
 
+            pair = self.src[self.pos:self.pos + 2]
+            if pair in compound_token_map:
+                self.advance()
+                self.advance()
+                return Token(compound_token_map[pair], pair, start_line, start_column)
+
             if self.current_char in token_map:
                 tok_type = token_map[self.current_char]
                 char = self.current_char
@@ -1,6 +1,8 @@
 from core.lexer import TokenType, LexerError
 from abc import ABC, abstractmethod
 from enum import Enum, auto
+import random
+import re
 
 class ParserError(Exception):
     def __init__(self, message, line, column):
@@ -11,11 +13,202 @@ class BuiltinTypes(Enum):
     Char = 1
     InlineString = 2
 
+def string_bytes(value):
+    """The bytes a string literal ends up as in the binary, escapes resolved."""
+    return value.encode('utf-8').decode('unicode_escape').encode('latin1')
+
+def string_literal(data):
+    """Source text of a string literal that ends up as the bytes data."""
+    return "".join(chr(b) if 32 <= b < 127 and b != ord("\\") else f"\\x{b:02x}" for b in data)
+
+# Types whose values are strings: a pointer and a length, in two stack slots
+STRING_TYPES = (BuiltinTypes.InlineString, BuiltinTypes.Char)
+
+def is_string(type):
+    return BuiltinTypes(type) in STRING_TYPES
+
+def stack_slots(types):
+    """Machine stack slots taken by values of the given types."""
+    return sum(2 if is_string(t) else 1 for t in types)
+
+def wrap_int(value):
+    """Wrap a Python int to the 64-bit two's complement range the generated code works in."""
+    return ((value + 2**63) % 2**64) - 2**63
+
+def fits_imm32(value):
+    return -2**31 <= value < 2**31
+
+def unsigned_magic(divisor):
+    """
+    Multiplier and shift that turn an unsigned 64-bit division by a constant
+    into a multiply (Granlund & Montgomery): n / d == (n * m) >> (64 + s)
+    for every n. The multiplier may need 65 bits.
+    """
+    for shift in range(65):
+        magic = (2**(64 + shift) + divisor - 1) // divisor
+        if magic * divisor - 2**(64 + shift) <= 2**shift:
+            return magic, shift
+    raise Exception(f"No magic number for {divisor}")
+
+def multiply_by_const(reg, value):
+    """Instructions multiplying reg by a constant in place, or None if it needs a scratch register."""
+    v = value % 2**64
+    if v == 0:
+        return [f"xor {reg}, {reg}"]
+    if v == 1:
+        return []
+    if v & (v - 1) == 0:
+        return [f"shl {reg}, {v.bit_length() - 1}"]
+    if v in (3, 5, 9):
+        return [f"lea {reg}, [{reg} + {reg} * {v - 1}]"]
+    if fits_imm32(value):
+        return [f"imul {reg}, {reg}, {value}"]
+    return None
+
+def update_in_place(loc, op, value):
+    """The instructions applying `op value` to a register or memory operand in place, or None if it takes more."""
+    if op in ("+", "-") and fits_imm32(value):
+        if value == 1:
+            return [f"{'inc' if op == '+' else 'dec'} {loc}"]
+        return [f"{'add' if op == '+' else 'sub'} {loc}, {value}"]
+    v = value % 2**64
+    if op == "*" and v and v & (v - 1) == 0:
+        return [f"shl {loc}, {v.bit_length() - 1}"] if v > 1 else []
+    return None
+
+def divide_by_const(loc, value):
+    """
+    Instructions dividing loc (a register other than rax/rdx, or memory) by a
+    nonzero unsigned constant in place. Powers of two shift, everything else
+    multiplies by the reciprocal in rax:rdx.
+    """
+    d = value % 2**64
+    if d == 1:
+        return []
+    if d & (d - 1) == 0:
+        return [f"shr {loc}, {d.bit_length() - 1}"]
+    magic, shift = unsigned_magic(d)
+    if magic < 2**64:
+        code = [f"mov rax, {magic}", f"mul {loc}"]
+        if shift:
+            code.append(f"shr rdx, {shift}")
+        return code + [f"mov {loc}, rdx"]
+    # 65 bit multiplier: add the dividend back in without overflowing
+    code = [f"mov rax, {magic - 2**64}", f"mul {loc}", f"mov rax, {loc}",
+            "sub rax, rdx", "shr rax, 1", "add rax, rdx"]
+    if shift > 1:
+        code.append(f"shr rax, {shift - 1}")
+    return code + [f"mov {loc}, rax"]
+
+def hash_width(strings):
+    """Bytes read from each end of a string when hashing it: the widest load every string is long enough for."""
+    shortest = min(len(s) for s in strings)
+    return next((w for w in (8, 4, 2, 1) if w <= shortest), 0)
+
+def string_key(data, width):
+    """What a string dispatch hashes: the string's length plus its first and last `width` bytes."""
+    if not width:
+        return len(data)
+    first = int.from_bytes(data[:width], "little")
+    last = int.from_bytes(data[-width:], "little")
+    return (first + last + len(data)) % 2**64
+
+def perfect_hash(keys):
+    """
+    A multiplier and table size in bits so that (key * multiplier) >> (64 - bits)
+    gives every key a slot of its own, or None if the search comes up empty.
+    The table is allowed to grow to 16 times the number of keys.
+    """
+    if len(set(keys)) != len(keys):
+        return None
+    rng = random.Random(len(keys))
+    least = max(1, (len(keys) - 1).bit_length())
+    for bits in range(least, least + 4):
+        for _ in range(1000):
+            multiplier = rng.getrandbits(64) | 1
+            if len({(key * multiplier) % 2**64 >> (64 - bits) for key in keys}) == len(keys):
+                return multiplier, bits
+    return None
+
+def load_bytes(reg, width, address):
+    """Zero extend `width` bytes at address into the 64-bit register reg."""
+    low = {"rax": "eax", "rdx": "edx"}[reg]
+    if width == 8:
+        return f"mov {reg}, qword [{address}]"
+    if width == 4:
+        return f"mov {low}, dword [{address}]"
+    return f"movzx {low}, {'word' if width == 2 else 'byte'} [{address}]"
+
+def string_hash(ptr, length, width, multiplier, bits):
+    """
+    Instructions leaving a string's slot in a perfect hash table in rax, with
+    rdx as scratch. ptr and length are registers or memory other than rax/rdx,
+    and the string has to be at least `width` bytes long.
+    """
+    code = [f"mov rax, {ptr}", f"mov rdx, {length}"]
+    if width:
+        code += [load_bytes("rdx", width, f"rax + rdx - {width}"), f"add rdx, {length}",
+                 load_bytes("rax", width, "rax"), "add rax, rdx"]
+    else:
+        code += ["mov rax, rdx"]
+    return code + [f"mov rdx, {multiplier}", "imul rax, rdx", f"shr rax, {64 - bits}"]
+
+# x86 condition code each comparison operator sets, and its negation.
+# Sweet integers are uint, so the relational ones use the unsigned codes.
+CONDITION_CODES = {"?": "e", "<": "b", ">": "a", "<=": "be", ">=": "ae"}
+NEGATED_CONDITIONS = {"e": "ne", "b": "ae", "a": "be", "be": "a", "ae": "b"}
+# IR instruction for each comparison operator on integers
+COMPARE_OPS = {"?": "eq", "<": "lt", ">": "gt", "<=": "le", ">=": "ge"}
+
+# Callee saved registers counted loops keep their induction variable in
+LOOP_REGS = ["r12", "r13", "r14", "r15"]
+
+def walk(node):
+    """Yield node and every node nested inside it."""
+    yield node
+    for value in vars(node).values():
+        for child in value if isinstance(value, list) else [value]:
+            if isinstance(child, ASTNode):
+                yield from walk(child)
+
+def branch_on_top(ctx, code, label, when):
+    """
+    Pop the top of the stack and jump to label if its truthiness equals
+    `when`. A string is true when it isn't empty, so only its length is
+    tested.
+    """
+    if ctx.stack_depth == 0:
+        raise Exception("Stack underflow in condition")
+    string = is_string(ctx.stack_types[-1])
+    if ctx.codegen == "tos":
+        reg = ctx.tos_pop(code)
+        if string:
+            ctx.tos_pop(code, avoid=(reg,))
+        code += ctx.tos_flush()
+    else:
+        code += ["    pop rax"] + (["    add rsp, 8"] if string else [])
+        reg = "rax"
+    ctx.stack_depth -= 1
+    ctx.stack_types.pop()
+    code += [f"    cmp {reg}, 0", f"    {'jne' if when else 'je'} {label}"]
+    return code
+
 class ASTNode(ABC):
     @abstractmethod
     def compile(self, ctx):
         pass
 
+    def lower(self, ir):
+        raise Exception(f"{type(self).__name__} can't be lowered to IR")
+
+    def fold(self):
+        """Return a constant equivalent of this node if it can be computed at compile time."""
+        return self
+
+    def compile_jump(self, ctx, label, when):
+        """Compile this node as a condition that jumps to label when its truthiness equals `when`."""
+        return branch_on_top(ctx, self.compile(ctx), label, when)
+
     def __repr__(self):
         return str(self)
     
@@ -27,8 +220,18 @@ class Number(ASTNode):
     def compile(self, ctx):
         ctx.stack_depth += 1
         ctx.stack_types.append(BuiltinTypes.UInt)
+        if ctx.codegen == "tos":
+            code = []
+            reg = ctx.tos_alloc(code)
+            ctx.cached.append(reg)
+            return code + [f"    mov {reg}, {self.value}"]
+        if not fits_imm32(self.value):
+            return [f"    mov rax, {self.value}", "    push rax"]
         return [f"    push {self.value}"]
 
+    def lower(self, ir):
+        ir.push(ir.emit("const", BuiltinTypes.UInt, imm=self.value))
+
     def __str__(self):
         return f"Number({self.value})"
 
@@ -38,13 +241,28 @@ class String(ASTNode):
 
     def compile(self, ctx):
         label = ctx.add_string(self.value)
+        length = len(string_bytes(self.value))
         ctx.stack_depth += 1
         ctx.stack_types.append(BuiltinTypes.InlineString)
+        if ctx.codegen == "tos":
+            code = []
+            ptr = ctx.tos_alloc(code)
+            ctx.cached.append(ptr)
+            code += [f"    lea {ptr}, [{label}]"]
+            reg = ctx.tos_alloc(code)
+            ctx.cached.append(reg)
+            return code + [f"    mov {reg}, {length}"]
         return [
             f"    lea rax, [{label}]",
-            "    push rax"
+            "    push rax",
+            f"    push {length}"
         ]
 
+    def lower(self, ir):
+        label = ir.ctx.add_string(self.value)
+        ptr = ir.emit("addr", BuiltinTypes.InlineString, label=label)
+        ir.push_string(ptr, ir.emit("const", BuiltinTypes.UInt, imm=len(string_bytes(self.value))))
+
     def __str__(self):
         return f'String("{self.value}")'
 
@@ -57,6 +275,8 @@ class BinaryOp(ASTNode):
     def compile(self, ctx):
         code = []
         code += self.left.compile(ctx)
+        if ctx.opt_level >= 1 and isinstance(self.right, Number):
+            return self.compile_const(ctx, code, self.right.value)
         code += self.right.compile(ctx)
 
         if len(ctx.stack_types) < 2:
@@ -67,23 +287,105 @@ class BinaryOp(ASTNode):
         if right_type != BuiltinTypes.UInt or left_type != BuiltinTypes.UInt:
             raise Exception("Binary operations only supported on numbers")
 
-        code += ["    pop rbx", "    pop rax"]
+        if ctx.codegen == "tos":
+            rreg = ctx.tos_pop(code)
+            lreg = ctx.tos_pop(code, avoid=(rreg,))
+        else:
+            code += ["    pop rbx", "    pop rax"]
+            rreg, lreg = "rbx", "rax"
         if self.op == "+":
-            code.append("    add rax, rbx")
+            code.append(f"    add {lreg}, {rreg}")
         elif self.op == "-":
-            code.append("    sub rax, rbx")
+            code.append(f"    sub {lreg}, {rreg}")
         elif self.op == "*":
-            code.append("    imul rax, rbx")
+            code.append(f"    imul {lreg}, {rreg}")
         elif self.op == "/":
-            code += ["    cqo", "    idiv rbx"]
+            if lreg != "rax":
+                code.append("    xchg rax, rbx")
+                lreg, rreg = "rax", "rbx"
+            # Sweet integers are uint, so this is an unsigned divide
+            code += ["    xor edx, edx", f"    div {rreg}"]
         else:
             raise Exception(f"Unknown binary operator {self.op}")
-        code += ["    push rax"]
+        if ctx.codegen == "tos":
+            ctx.cached.append(lreg)
+        else:
+            code += ["    push rax"]
 
         ctx.stack_types.append(BuiltinTypes.UInt)
         ctx.stack_depth -= 1
         return code
 
+    def compile_const(self, ctx, code, value):
+        """Apply the operator to the left operand and a constant without materializing the constant."""
+        if not ctx.stack_types:
+            raise Exception("Stack underflow in BinaryOp")
+        if BuiltinTypes(ctx.stack_types.pop()) != BuiltinTypes.UInt:
+            raise Exception("Binary operations only supported on numbers")
+        ctx.stack_types.append(BuiltinTypes.UInt)
+        if ctx.codegen == "tos":
+            reg = ctx.tos_pop(code)
+        else:
+            code += ["    pop rax"]
+            reg = "rax"
+
+        # rcx is never part of the Sweet stack, so it's free as a scratch register
+        if self.op in ("+", "-"):
+            mnemonic = "add" if self.op == "+" else "sub"
+            if fits_imm32(value):
+                ops = [f"{mnemonic} {reg}, {value}"]
+            else:
+                ops = [f"mov rcx, {value}", f"{mnemonic} {reg}, rcx"]
+        elif self.op == "*":
+            ops = multiply_by_const(reg, value)
+            if ops is None:
+                ops = [f"mov rcx, {value}", f"imul {reg}, rcx"]
+        elif self.op == "/":
+            if value % 2**64 == 0:
+                raise Exception("Division by constant zero")
+            if reg == "rax":
+                ops = ["mov rcx, rax"] + divide_by_const("rcx", value) + ["mov rax, rcx"]
+            else:
+                ops = divide_by_const(reg, value)
+                # The reciprocal multiply goes through rax, which may cache the value below
+                if "rax" in ctx.cached and any("rax" in op for op in ops):
+                    ops = ["push rax"] + ops + ["pop rax"]
+        else:
+            raise Exception(f"Unknown binary operator {self.op}")
+        code += [f"    {op}" for op in ops]
+
+        if ctx.codegen == "tos":
+            ctx.cached.append(reg)
+        else:
+            code += ["    push rax"]
+        return code
+
+    def lower(self, ir):
+        self.left.lower(ir)
+        self.right.lower(ir)
+        right = ir.pop("BinaryOp")
+        left = ir.pop("BinaryOp")
+        if right.type != BuiltinTypes.UInt or left.type != BuiltinTypes.UInt:
+            raise Exception("Binary operations only supported on numbers")
+        ops = {"+": "add", "-": "sub", "*": "mul", "/": "div"}
+        if self.op not in ops:
+            raise Exception(f"Unknown binary operator {self.op}")
+        ir.push(ir.emit(ops[self.op], BuiltinTypes.UInt, [left, right]))
+
+    def fold(self):
+        if not isinstance(self.left, Number) or not isinstance(self.right, Number):
+            return self
+        a, b = self.left.value, self.right.value
+        if self.op == "+":
+            return Number(wrap_int(a + b))
+        if self.op == "-":
+            return Number(wrap_int(a - b))
+        if self.op == "*":
+            return Number(wrap_int(a * b))
+        if self.op == "/" and b != 0:
+            return Number(wrap_int((a % 2**64) // (b % 2**64)))
+        return self
+
     def __str__(self):
         return f"BinaryOp({self.op}, {self.left}, {self.right})"
 
@@ -94,8 +396,27 @@ class Dup(ASTNode):
         top_type = ctx.stack_types[-1]
         ctx.stack_depth += 1
         ctx.stack_types.append(top_type)
+        if is_string(top_type):
+            # Both slots are copied from memory, the pointer first
+            return ctx.tos_flush() + ["    push qword [rsp + 8]"] * 2
+        if ctx.codegen == "tos":
+            code = []
+            if ctx.cached:
+                top = ctx.cached[-1]
+                reg = ctx.tos_alloc(code)
+                code.append(f"    mov {reg}, {top}")
+            else:
+                reg = ctx.tos_alloc(code)
+                code.append(f"    mov {reg}, [rsp]")
+            ctx.cached.append(reg)
+            return code
         return ["    pop rax", "    push rax", "    push rax"]
 
+    def lower(self, ir):
+        top = ir.pop("Dup")
+        ir.push(top)
+        ir.push(top)
+
     def __str__(self):
         return "Dup()"
 
@@ -106,48 +427,313 @@ class Print(ASTNode):
             raise Exception("Stack underflow in Print")
         typ = BuiltinTypes(ctx.stack_types[-1])
         code = []
-        if typ in (BuiltinTypes.InlineString, BuiltinTypes.Char):
+        if is_string(typ):
+            # The string's slots are print_str's arguments as they are
+            if ctx.codegen == "tos":
+                ctx.tos_pop(code, "rsi")
+                ctx.tos_pop(code, "rdi")
+                code += ctx.tos_flush()
+            else:
+                code += ["    pop rsi", "    pop rdi"]
             ctx.stack_types.pop()
             ctx.stack_depth -= 1
             code += [
-                "    pop rdi",
                 "    push rbp",
                 "    call print_str",
                 "    pop rbp"
             ]
         else:
+            if ctx.codegen == "tos":
+                ctx.tos_pop(code, "rdi")
+                code += ctx.tos_flush()
+            else:
+                code += ["    pop rdi"]
             ctx.stack_types.pop()
             ctx.stack_depth -= 1
             code += [
-                "    pop rdi",
                 "    push rbp",
-                "    call print_int",
+                "    call print_uint",
                 "    pop rbp"
             ]
         return code
 
+    def lower(self, ir):
+        value = ir.pop("Print")
+        if is_string(value.type):
+            ir.emit("call", args=[value.ptr, value.length], func="print_str")
+        else:
+            ir.emit("call", args=[value], func="print_uint")
+
     def __str__(self):
         return "Print()"
 
+class PrintRun(ASTNode):
+    """
+    Consecutive prints of literals and variables, printed by one print_parts
+    call. Its argument is an array of (pointer, length) pairs in .data with
+    everything known at compile time filled in; integer variables go in the
+    pointer half with a negative length telling libsw how to format them.
+    """
+    # Length that marks each way of formatting an integer part
+    INTEGER_PARTS = {"uint": -1, "int": -2, "int32": -3, "uint32": -4}
+
+    def __init__(self, parts):
+        # String literals and (LoadVar, conversion) pairs in print order. A
+        # conversion of None prints the variable the way Print would.
+        self.parts = parts
+
+    def conversion(self, ctx, var, conversion):
+        if not hasattr(ctx, "vars") or var.name not in ctx.vars:
+            raise Exception(f"Var '{var.name}' not defined")
+        if conversion is None:
+            return "str" if BuiltinTypes(ctx.vars[var.name][2]) == BuiltinTypes.Char else "uint"
+        return conversion
+
+    def layout(self, ctx):
+        """The table's initial qwords, and the (offset, variable) pairs that get stored at run time."""
+        values, stores = [], []
+        for idx, part in enumerate(self.parts):
+            if isinstance(part, String):
+                values += [ctx.add_string(part.value), len(string_bytes(part.value))]
+                continue
+            var, conversion = part
+            if self.conversion(ctx, var, conversion) == "str":
+                # The buffer never moves, only its length changes
+                values += [ctx.vars[var.name][0], 0]
+                stores.append((16 * idx + 8, var))
+            else:
+                values += [0, self.INTEGER_PARTS[self.conversion(ctx, var, conversion)]]
+                stores.append((16 * idx, var))
+        label = ctx.new_label()
+        ctx.data_tables.append((label, values))
+        return label, stores
+
+    def compile(self, ctx):
+        label, stores = self.layout(ctx)
+        code = ctx.tos_flush()
+        for offset, var in stores:
+            lbl, size, t, *rest = ctx.vars[var.name]
+            if BuiltinTypes(t) == BuiltinTypes.Char:
+                code += [f"    mov rax, [{lbl} - 8]"]
+                src = "rax"
+            else:
+                src = var.location(ctx)
+                if "[" in src:
+                    code += [f"    mov rax, {src}"]
+                    src = "rax"
+            code += [f"    mov qword [{label} + {offset}], {src}"]
+        return code + [
+            f"    lea rdi, [{label}]",
+            f"    mov rsi, {len(self.parts)}",
+            "    push rbp",
+            "    call print_parts",
+            "    pop rbp"
+        ]
+
+    def lower(self, ir):
+        self.lower_print(ir)
+
+    def lower_print(self, ir, type=None):
+        """Emit the stores and the call, whose result (the bytes printed) gets a register of `type`."""
+        label, stores = self.layout(ir.ctx)
+        for offset, var in stores:
+            var.lower(ir)
+            value = ir.pop("PrintRun")
+            if value.type == BuiltinTypes.Char:
+                value = value.length
+            ir.emit("store", args=[value], label=label, offset=offset)
+        table = ir.emit("addr", BuiltinTypes.UInt, label=label)
+        count = ir.emit("const", BuiltinTypes.UInt, imm=len(self.parts))
+        return ir.emit("call", type, [table, count], func="print_parts")
+
+    def __str__(self):
+        return f"{type(self).__name__}({self.parts})"
+
+def add_print_part(parts, part):
+    """Append a String or variable part, merging adjacent literals into one."""
+    if isinstance(part, String) and parts and isinstance(parts[-1], String):
+        # Join the bytes, not the source text: "\1" followed by "2" is not "\12"
+        parts[-1] = String(string_literal(string_bytes(parts[-1].value) + string_bytes(part.value)))
+    else:
+        parts.append(part)
+
+def coalesce_prints(nodes):
+    """
+    Merge runs of `x print` where x is a literal or a variable: adjacent
+    literals become one pre-rendered string, and a run that still has more
+    than one piece becomes a PrintRun.
+    """
+    result = []
+    idx = 0
+    while idx < len(nodes):
+        run = []
+        while (idx + 2 * len(run) + 1 < len(nodes)
+               and isinstance(nodes[idx + 2 * len(run)], (String, Number, LoadVar))
+               and isinstance(nodes[idx + 2 * len(run) + 1], Print)):
+            run.append(nodes[idx + 2 * len(run)])
+        if len(run) < 2:
+            result.append(nodes[idx])
+            idx += 1
+            continue
+        idx += 2 * len(run)
+
+        parts = []
+        for node in run:
+            if isinstance(node, Number):
+                # Numbers print as the uint they are
+                node = String(str(node.value % 2**64))
+            add_print_part(parts, node if isinstance(node, String) else (node, None))
+        if len(parts) == 1:
+            result += [parts[0], Print()]
+        else:
+            result.append(PrintRun(parts))
+    return result
+
+# printf conversions FormattedPrint handles, and how it prints each
+PRINTF_CONVERSIONS = {
+    b"s": "str",
+    b"d": "int32", b"i": "int32", b"u": "uint32",
+    b"ld": "int", b"li": "int", b"lld": "int", b"lli": "int", b"zd": "int",
+    b"lu": "uint", b"llu": "uint", b"zu": "uint",
+}
+
+def format_integer(value, conversion):
+    """The text printf gives a constant argument under an integer conversion."""
+    value %= 2**64
+    if conversion in ("int32", "uint32"):
+        value %= 2**32
+    if conversion == "int32" and value >= 2**31:
+        value -= 2**32
+    if conversion == "int" and value >= 2**63:
+        value -= 2**64
+    return str(value)
+
+class FormattedPrint(PrintRun):
+    """
+    A printf or dprintf to stdout with a literal format, split into its
+    pieces at compile time and printed through print_parts like a PrintRun.
+    It leaves the number of bytes printed, like printf does. If a variable
+    turns out not to have the type its conversion expects, the original
+    call is compiled instead.
+    """
+    def __init__(self, parts, fallback):
+        super().__init__(parts)
+        self.fallback = fallback
+
+    @classmethod
+    def from_call(cls, call, args):
+        """The FormattedPrint for call with the nodes pushing its arguments, or None if it can't be one."""
+        if call.func == "dprintf":
+            if not args or not isinstance(args[0], Number) or args[0].value != 1:
+                return None
+            fmt, values = args[1:2], args[2:]
+        elif call.func == "printf":
+            fmt, values = args[:1], args[1:]
+        else:
+            return None
+        if not fmt or not isinstance(fmt[0], String):
+            return None
+        if not all(isinstance(v, (String, Number, LoadVar)) for v in values):
+            return None
+
+        # printf stops at the first NUL, of the format and of %s arguments
+        data = string_bytes(fmt[0].value).split(bytes(1))[0]
+        parts, values = [], list(values)
+        pieces = re.split(rb"(%%|%(?:ll|l|z)?[a-zA-Z]|%)", data)
+        for idx, piece in enumerate(pieces):
+            if idx % 2 == 0:
+                if piece:
+                    add_print_part(parts, String(string_literal(piece)))
+                continue
+            if piece == b"%%":
+                add_print_part(parts, String("%"))
+                continue
+            conversion = PRINTF_CONVERSIONS.get(piece[1:])
+            if conversion is None or not values:
+                return None
+            value = values.pop(0)
+            if isinstance(value, LoadVar):
+                add_print_part(parts, (value, conversion))
+            elif conversion == "str" and isinstance(value, String):
+                add_print_part(parts, String(string_literal(string_bytes(value.value).split(bytes(1))[0])))
+            elif conversion != "str" and isinstance(value, Number):
+                add_print_part(parts, String(format_integer(value.value, conversion)))
+            else:
+                return None
+        if values:
+            return None
+        return cls(parts, list(args) + [call])
+
+    def types_match(self, ctx):
+        variables = getattr(ctx, "vars", {})
+        for part in self.parts:
+            if isinstance(part, String):
+                continue
+            var, conversion = part
+            if var.name not in variables:
+                return False
+            if (BuiltinTypes(variables[var.name][2]) == BuiltinTypes.Char) != (conversion == "str"):
+                return False
+        return True
+
+    def compile(self, ctx):
+        if not self.types_match(ctx):
+            return [line for node in self.fallback for line in node.compile(ctx)]
+        code = super().compile(ctx)
+        ctx.stack_depth += 1
+        ctx.stack_types.append(BuiltinTypes.UInt)
+        if ctx.codegen == "tos":
+            ctx.cached.append("rax")
+        else:
+            code += ["    push rax"]
+        return code
+
+    def lower(self, ir):
+        if not self.types_match(ir.ctx):
+            for node in self.fallback:
+                node.lower(ir)
+            return
+        ir.push(self.lower_print(ir, BuiltinTypes.UInt))
+
 class Input(ASTNode):
+    """
+    Reads a line. stdin_getline is told how many strings are on the stack:
+    any of them may be a line it handed out before, which has to stay
+    where it is.
+    """
     def compile(self, ctx):
-        code = []
+        live = sum(1 for t in ctx.stack_types if BuiltinTypes(t) == BuiltinTypes.InlineString)
+        code = ctx.tos_flush()
         code += [
+            f"    mov rdi, {live}",
             "    push rbp",
             "    call stdin_getline",
-            "    pop rbp",
-            "    push rax"
+            "    pop rbp"
         ]
-        ctx.stack_types.append(BuiltinTypes.String)
+        # The line comes back as its pointer in rax and its length in rdx
+        if ctx.codegen == "tos":
+            code += ["    mov rbx, rdx"]
+            ctx.cached += ["rax", "rbx"]
+        else:
+            code += ["    push rax", "    push rdx"]
+        ctx.stack_types.append(BuiltinTypes.InlineString)
         ctx.stack_depth += 1
         return code
     
+    def lower(self, ir):
+        live = sum(1 for v in ir.stack if v.type == BuiltinTypes.InlineString)
+        live = ir.emit("const", BuiltinTypes.UInt, imm=live)
+        line = ir.emit("call", BuiltinTypes.InlineString, [live], func="stdin_getline")
+        ir.push_string(line, ir.emit("second", BuiltinTypes.UInt, [line]))
+
     def __str__(self):
         return "Input()"
 
 
 
 class Compare(ASTNode):
+    op = "?"
+
     def __init__(self, left, right):
         self.left = left
         self.right = right
@@ -156,44 +742,147 @@ class Compare(ASTNode):
         code = []
         code += self.left.compile(ctx)
         code += self.right.compile(ctx)
+        return self.compile_op(ctx, code)
+
+    def compile_jump(self, ctx, label, when):
+        cc = CONDITION_CODES[self.op]
+        jump = f"j{cc if when else NEGATED_CONDITIONS[cc]}"
+        if isinstance(self.left, LoadVar) and self.left.name in ctx.var_regs:
+            # A counted loop's induction variable is compared in its register
+            right = None
+            if isinstance(self.right, Number) and fits_imm32(self.right.value):
+                right = str(self.right.value)
+            elif (isinstance(self.right, LoadVar) and self.right.name in getattr(ctx, "vars", {})
+                    and BuiltinTypes(ctx.vars[self.right.name][2]) == BuiltinTypes.UInt):
+                right = self.right.location(ctx)
+            if right is not None:
+                return ctx.tos_flush() + [f"    cmp {ctx.var_regs[self.left.name]}, {right}", f"    {jump} {label}"]
 
+        code = []
+        code += self.left.compile(ctx)
+        immediate = isinstance(self.right, Number) and fits_imm32(self.right.value)
+        if not immediate:
+            code += self.right.compile(ctx)
+            if len(ctx.stack_types) < 2:
+                raise Exception("Stack underflow in Compare")
+            if BuiltinTypes(ctx.stack_types[-1]) != BuiltinTypes.UInt or BuiltinTypes(ctx.stack_types[-2]) != BuiltinTypes.UInt:
+                return branch_on_top(ctx, self.compile_op(ctx, code), label, when)
+        elif not ctx.stack_types or BuiltinTypes(ctx.stack_types[-1]) != BuiltinTypes.UInt:
+            code += self.right.compile(ctx)
+            return branch_on_top(ctx, self.compile_op(ctx, code), label, when)
+
+        # Integer compares need no call: compare the operands and branch on the flags
+        if immediate:
+            right = str(self.right.value)
+            if ctx.codegen == "tos":
+                left = ctx.tos_pop(code)
+            else:
+                code += ["    pop rax"]
+                left = "rax"
+            ctx.stack_types.pop()
+            ctx.stack_depth -= 1
+        else:
+            if ctx.codegen == "tos":
+                right = ctx.tos_pop(code)
+                left = ctx.tos_pop(code, avoid=(right,))
+            else:
+                code += ["    pop rbx", "    pop rax"]
+                left, right = "rax", "rbx"
+            ctx.stack_types.pop()
+            ctx.stack_types.pop()
+            ctx.stack_depth -= 2
+        code += ctx.tos_flush()
+        code += [f"    cmp {left}, {right}", f"    {jump} {label}"]
+        return code
+
+    def compile_op(self, ctx, code):
         if len(ctx.stack_types) < 2:
             raise Exception("Stack underflow in Compare")
         rt = BuiltinTypes(ctx.stack_types.pop())
         lt = BuiltinTypes(ctx.stack_types.pop())
 
-        if lt in (BuiltinTypes.InlineString, BuiltinTypes.Char) and rt in (BuiltinTypes.InlineString, BuiltinTypes.Char):
-            ctx.stack_depth -= 2
+        integers = lt == BuiltinTypes.UInt and rt == BuiltinTypes.UInt
+        if not integers and not (self.op == "?" and is_string(lt) and is_string(rt)):
+            raise Exception(f"Can't compare {lt} with {rt} using {self.op}")
+
+        ctx.stack_depth -= 2
+        if integers:
+            # Integer compares are a single cmp, far cheaper than a call
+            if ctx.codegen == "tos":
+                right = ctx.tos_pop(code)
+                left = ctx.tos_pop(code, avoid=(right,))
+            else:
+                code += ["    pop rbx", "    pop rax"]
+                left, right = "rax", "rbx"
+            low = left[1] + "l"
+            cc = CONDITION_CODES[self.op]
+            code += [f"    cmp {left}, {right}", f"    set{cc} {low}", f"    movzx {left}, {low}"]
+            if ctx.codegen == "tos":
+                ctx.cached.append(left)
+            else:
+                code += ["    push rax"]
+        else:
+            # compare_str takes both strings as (pointer, length), in stack order
+            if ctx.codegen == "tos":
+                for reg in ("rcx", "rdx", "rsi", "rdi"):
+                    ctx.tos_pop(code, reg)
+                code += ctx.tos_flush()
+            else:
+                code += ["    pop rcx", "    pop rdx", "    pop rsi", "    pop rdi"]
             code += [
-                "    pop rsi",
-                "    pop rdi",
                 "    push rbp",
                 "    call compare_str",
-                "    pop rbp",
-                "    push rax"
-            ]
-            ctx.stack_types.append(BuiltinTypes.UInt)
-            ctx.stack_depth += 1
-        elif lt == BuiltinTypes.UInt and rt == BuiltinTypes.UInt:
-            ctx.stack_depth -= 2
-            code += [
-                "    pop rsi",
-                "    pop rdi",
-                "    push rbp",
-                "    call compare_int",
-                "    pop rbp",
-                "    push rax"
+                "    pop rbp"
             ]
-            ctx.stack_types.append(BuiltinTypes.UInt)
-            ctx.stack_depth += 1
-        else:
-            raise Exception(f"Can't compare {lt} with {rt}")
+            if ctx.codegen == "tos":
+                ctx.cached.append("rax")
+            else:
+                code += ["    push rax"]
+        ctx.stack_types.append(BuiltinTypes.UInt)
+        ctx.stack_depth += 1
 
         return code
 
+    def lower(self, ir):
+        self.left.lower(ir)
+        self.right.lower(ir)
+        right = ir.pop("Compare")
+        left = ir.pop("Compare")
+        if left.type == BuiltinTypes.UInt and right.type == BuiltinTypes.UInt:
+            ir.push(ir.emit(COMPARE_OPS[self.op], BuiltinTypes.UInt, [left, right]))
+        elif self.op == "?" and is_string(left.type) and is_string(right.type):
+            args = [left.ptr, left.length, right.ptr, right.length]
+            ir.push(ir.emit("call", BuiltinTypes.UInt, args, func="compare_str"))
+        else:
+            raise Exception(f"Can't compare {left.type} with {right.type} using {self.op}")
+
+    def fold(self):
+        if isinstance(self.left, Number) and isinstance(self.right, Number):
+            # Both sides are uint, so values that only differ by 2**64 are equal
+            return Number(int(self.left.value % 2**64 == self.right.value % 2**64))
+        if isinstance(self.left, String) and isinstance(self.right, String):
+            return Number(int(string_bytes(self.left.value) == string_bytes(self.right.value)))
+        return self
+
     def __str__(self):
         return f"Compare({self.left}, {self.right})"
 
+class Relational(Compare):
+    """An unsigned <, >, <= or >= between two integers. Shares Compare's integer paths."""
+    def __init__(self, op, left, right):
+        super().__init__(left, right)
+        self.op = op
+
+    def fold(self):
+        if isinstance(self.left, Number) and isinstance(self.right, Number):
+            left, right = self.left.value % 2**64, self.right.value % 2**64
+            result = {"<": left < right, ">": left > right, "<=": left <= right, ">=": left >= right}[self.op]
+            return Number(int(result))
+        return self
+
+    def __str__(self):
+        return f"Relational({self.op}, {self.left}, {self.right})"
+
 class IfElse(ASTNode):
     def __init__(self, condition, if_body, else_body=None):
         self.condition = condition
@@ -202,32 +891,416 @@ class IfElse(ASTNode):
 
     def compile(self, ctx):
         code = []
-        code += self.condition.compile(ctx)
-        if ctx.stack_depth == 0:
-            raise Exception("Stack underflow in If condition")
-        code += ["    pop rax"]
-        ctx.stack_depth -= 1
         else_label = ctx.new_label()
         end_label = ctx.new_label()
-
-        code += [
-            "    cmp rax, 0",
-            f"    je {else_label}"
-        ]
+        if ctx.opt_level >= 1:
+            code += self.condition.compile_jump(ctx, else_label, False)
+        else:
+            code += branch_on_top(ctx, self.condition.compile(ctx), else_label, False)
         for node in self.if_body:
             code += node.compile(ctx)
+        code += ctx.tos_flush()
         code += [f"    jmp {end_label}"]
         code += [f"{else_label}:"]
         if self.else_body:
             for node in self.else_body:
                 code += node.compile(ctx)
+            code += ctx.tos_flush()
         code += [f"{end_label}:"]
         return code
 
+    def lower(self, ir):
+        self.condition.lower(ir)
+        cond = ir.truth(ir.pop("If condition"))
+        state = ir.canonicalize()
+        then_block = ir.new_block()
+        else_block = ir.new_block()
+        end_block = ir.new_block()
+        ir.branch(cond, then_block, else_block)
+
+        ir.start_block(then_block, state)
+        for node in self.if_body:
+            node.lower(ir)
+        then_state = ir.canonicalize()
+        ir.jump(end_block)
+
+        ir.start_block(else_block, state)
+        for node in self.else_body or []:
+            node.lower(ir)
+        else_state = ir.canonicalize()
+        ir.jump(end_block)
+
+        if [v.type for v in then_state] != [v.type for v in else_state]:
+            raise Exception("If and else branches leave different stacks")
+        ir.start_block(end_block, then_state)
+
     def __str__(self):
         else_str = f", else_body={self.else_body}" if self.else_body else ""
         return f"IfElse({self.condition}, {self.if_body}{else_str})"
 
+def if_chain(node):
+    """
+    Split `c1 if b1 else c2 if b2 else .. end end` into its (condition, body)
+    pairs and the body of the last else.
+    """
+    cases = []
+    while True:
+        cases.append((node.condition, node.if_body))
+        rest = node.else_body or []
+        if len(rest) == 1 and isinstance(rest[0], Switch):
+            rest = [rest[0].chain]
+        if len(rest) != 1 or not isinstance(rest[0], IfElse):
+            return cases, rest
+        node = rest[0]
+
+class Switch(ASTNode):
+    """
+    An if/else chain testing one variable for equality with a constant in
+    every condition. Subclasses decide how to find the case a value belongs
+    to; the case bodies and the final else compile the same for all of
+    them. If the variable turns out to have a type the dispatch can't
+    handle, the original chain is compiled instead.
+    """
+    LITERAL = None
+    TYPE = None
+    MIN_CASES = 3
+
+    def __init__(self, chain, subject, cases, default):
+        self.chain = chain
+        self.subject = subject
+        # (key, literal, body) for every case, in source order
+        self.cases = cases
+        self.default = default
+
+    @classmethod
+    def from_chain(cls, node):
+        """The switch an IfElse chain compiles to, or None if it isn't one."""
+        conditions, default = if_chain(node)
+        subject, cases, seen = None, [], set()
+        for condition, body in conditions:
+            if type(condition) is not Compare:
+                return None
+            sides = [condition.left, condition.right]
+            var = next((n for n in sides if isinstance(n, LoadVar)), None)
+            literal = next((n for n in sides if isinstance(n, cls.LITERAL)), None)
+            if var is None or literal is None or (subject and var.name != subject.name):
+                return None
+            subject = var
+            key = cls.key(literal)
+            # Only the first of two equal constants can ever match
+            if key not in seen:
+                seen.add(key)
+                cases.append((key, literal, body))
+        if len(cases) < cls.MIN_CASES:
+            return None
+        return cls.build(node, subject, cases, default)
+
+    @classmethod
+    def build(cls, chain, subject, cases, default):
+        return cls(chain, subject, cases, default)
+
+    def subject_matches(self, ctx):
+        if not hasattr(ctx, "vars") or self.subject.name not in ctx.vars:
+            return False
+        return BuiltinTypes(ctx.vars[self.subject.name][2]) == self.TYPE
+
+    def compile_entry(self, ctx, case, default_label):
+        """Code between the dispatch landing on a case and its body."""
+        return []
+
+    def entry_blocks(self, ir):
+        """Blocks the dispatch lands in for a case, the last of which runs its body."""
+        return [ir.new_block()]
+
+    def lower_entry(self, ir, case, blocks, value, default_block, state):
+        pass
+
+    def compile(self, ctx):
+        if not self.subject_matches(ctx):
+            return self.chain.compile(ctx)
+        entries = [ctx.new_label() for _ in self.cases]
+        default_label = ctx.new_label()
+        end_label = ctx.new_label()
+
+        code = ctx.tos_flush()
+        code += self.compile_dispatch(ctx, entries, default_label)
+        for entry, case in zip(entries, self.cases):
+            code += [f"{entry}:"]
+            code += self.compile_entry(ctx, case, default_label)
+            for node in case[2]:
+                code += node.compile(ctx)
+            code += ctx.tos_flush()
+            code += [f"    jmp {end_label}"]
+        code += [f"{default_label}:"]
+        for node in self.default:
+            code += node.compile(ctx)
+        code += ctx.tos_flush()
+        code += [f"{end_label}:"]
+        return code
+
+    def lower(self, ir):
+        if not self.subject_matches(ir.ctx):
+            return self.chain.lower(ir)
+        self.subject.lower(ir)
+        value = ir.pop("match")
+        value = self.lower_value(ir, value)
+        state = ir.canonicalize()
+        dispatch = self.dispatch_blocks(ir)
+        entries = [self.entry_blocks(ir) for _ in self.cases]
+        default_block = ir.new_block()
+        end_block = ir.new_block()
+        self.lower_dispatch(ir, value, dispatch, [blocks[0] for blocks in entries], default_block, state)
+
+        states = []
+        for blocks, case in zip(entries, self.cases):
+            self.lower_entry(ir, case, blocks, value, default_block, state)
+            ir.start_block(blocks[-1], state)
+            for node in case[2]:
+                node.lower(ir)
+            states.append(ir.canonicalize())
+            ir.jump(end_block)
+
+        ir.start_block(default_block, state)
+        for node in self.default:
+            node.lower(ir)
+        states.append(ir.canonicalize())
+        ir.jump(end_block)
+
+        if any([v.type for v in s] != [v.type for v in states[0]] for s in states):
+            raise Exception("Match cases leave different stacks")
+        ir.start_block(end_block, states[0])
+
+    def lower_value(self, ir, value):
+        return value
+
+    def __str__(self):
+        cases = ", ".join(f"{literal}: {body}" for _, literal, body in self.cases)
+        return f"{type(self).__name__}({self.subject}, {{{cases}}}, default={self.default})"
+
+def jump_table(index, table, targets):
+    """
+    NASM lines jumping to targets[index] through a table of 32-bit offsets
+    placed right after the jump. index is a register other than rdx, and
+    has to be in range. Clobbers rax and rdx.
+    """
+    code = [
+        f"    lea rdx, [{table}]",
+        f"    movsxd rax, dword [rdx + {index} * 4]",
+        "    add rax, rdx",
+        "    jmp rax",
+        "    align 4",
+        f"{table}:"
+    ]
+    return code + [f"    dd {target} - {table}" for target in targets]
+
+class StringSwitch(Switch):
+    """
+    Tests a char variable against string literals. Instead of a compare_str
+    per case it hashes the variable once, jumps through a table built from
+    a perfect hash of the literals, and verifies the single candidate it
+    lands on.
+    """
+    LITERAL = String
+    TYPE = BuiltinTypes.Char
+
+    @staticmethod
+    def key(literal):
+        return string_bytes(literal.value)
+
+    @classmethod
+    def build(cls, chain, subject, cases, default):
+        width = hash_width([data for data, _, _ in cases])
+        found = perfect_hash([string_key(data, width) for data, _, _ in cases])
+        if found is None:
+            return None
+        switch = cls(chain, subject, cases, default)
+        switch.width = width
+        switch.multiplier, switch.bits = found
+        switch.min_length = min(len(data) for data, _, _ in cases)
+        return switch
+
+    def slots(self):
+        """The case every slot of the jump table belongs to, None for empty slots."""
+        table = [None] * 2**self.bits
+        for idx, (data, _, _) in enumerate(self.cases):
+            table[(string_key(data, self.width) * self.multiplier) % 2**64 >> (64 - self.bits)] = idx
+        return table
+
+    def compile_dispatch(self, ctx, entries, default_label):
+        code = [f"    lea rdi, [{ctx.vars[self.subject.name][0]}]", "    mov rsi, [rdi - 8]"]
+        if self.width:
+            # Too short for the hash's loads, and for every literal
+            code += [f"    cmp rsi, {self.min_length}", f"    jb {default_label}"]
+        code += [f"    {line}" for line in string_hash("rdi", "rsi", self.width, self.multiplier, self.bits)]
+        targets = [default_label if idx is None else entries[idx] for idx in self.slots()]
+        return code + jump_table("rax", ctx.new_label(), targets)
+
+    def compile_entry(self, ctx, case, default_label):
+        data, literal, _ = case
+        # rdi and rsi still hold the variable and its length
+        return [
+            f"    cmp rsi, {len(data)}",
+            f"    jne {default_label}",
+            f"    lea rdx, [{ctx.add_string(literal.value)}]",
+            f"    mov rcx, {len(data)}",
+            "    push rbp",
+            "    call compare_str",
+            "    pop rbp",
+            "    cmp rax, 0",
+            f"    je {default_label}"
+        ]
+
+    def lower_value(self, ir, value):
+        return value.ptr, value.length
+
+    def dispatch_blocks(self, ir):
+        return [ir.new_block()] if self.width else []
+
+    def lower_dispatch(self, ir, value, blocks, entries, default_block, state):
+        string, length = value
+        if self.width:
+            too_short = ir.emit("lt", BuiltinTypes.UInt, [length, ir.emit("const", BuiltinTypes.UInt, imm=self.min_length)])
+            ir.branch(too_short, default_block, blocks[0])
+            ir.start_block(blocks[0], state)
+        slot = ir.emit("strhash", BuiltinTypes.UInt, [string, length], imm=self.multiplier,
+                       offset=self.width, bits=self.bits)
+        ir.switch(slot, [default_block if idx is None else entries[idx] for idx in self.slots()])
+
+    def entry_blocks(self, ir):
+        return [ir.new_block(), ir.new_block(), ir.new_block()]
+
+    def lower_entry(self, ir, case, blocks, value, default_block, state):
+        data, literal, _ = case
+        string, length = value
+        check, verify, body = blocks
+        ir.start_block(check, state)
+        expected = ir.emit("const", BuiltinTypes.UInt, imm=len(data))
+        ir.branch(ir.emit("eq", BuiltinTypes.UInt, [length, expected]), verify, default_block)
+        ir.start_block(verify, state)
+        literal_value = ir.emit("addr", BuiltinTypes.InlineString, label=ir.ctx.add_string(literal.value))
+        equal = ir.emit("call", BuiltinTypes.UInt, [string, length, literal_value, expected], func="compare_str")
+        ir.branch(equal, body, default_block)
+
+class IntSwitch(Switch):
+    """
+    Tests a uint variable against integer constants. Constants that fill at
+    least a third of the range they span get a bounds check and a jump
+    table, sparser ones a binary search that needs about log2(n) compares.
+    """
+    LITERAL = Number
+    TYPE = BuiltinTypes.UInt
+    MIN_CASES = 4
+    # Most jump table slots allowed per case, and in total
+    TABLE_DENSITY = 3
+    MAX_TABLE = 1024
+    # Cases searched by straight compares once the search gets down to them
+    LINEAR_CASES = 3
+
+    @staticmethod
+    def key(literal):
+        return literal.value % 2**64
+
+    @classmethod
+    def build(cls, chain, subject, cases, default):
+        switch = cls(chain, subject, cases, default)
+        keys = [key for key, _, _ in cases]
+        switch.low = min(keys)
+        switch.span = max(keys) - switch.low + 1
+        switch.dense = switch.span <= min(cls.TABLE_DENSITY * len(keys), cls.MAX_TABLE)
+        return switch
+
+    def slots(self):
+        """The case every value from low on jumps to, None for values without one."""
+        table = [None] * self.span
+        for idx, (key, _, _) in enumerate(self.cases):
+            table[key - self.low] = idx
+        return table
+
+    def search_tree(self, cases):
+        """
+        The compares a binary search over (key, case) pairs sorted by key
+        makes: a ("linear", cases) leaf, or ("split", key, case, below, above)
+        testing one key and going on below or above it.
+        """
+        if len(cases) <= self.LINEAR_CASES:
+            return ("linear", cases)
+        mid = len(cases) // 2
+        key, idx = cases[mid]
+        return ("split", key, idx, self.search_tree(cases[:mid]), self.search_tree(cases[mid + 1:]))
+
+    def compile_dispatch(self, ctx, entries, default_label):
+        code = [f"    mov rax, {self.subject.location(ctx)}"]
+        if self.dense:
+            if self.low:
+                code += self.compare_lines("sub", self.low)
+            code += [f"    cmp rax, {self.span - 1}", f"    ja {default_label}"]
+            targets = [default_label if idx is None else entries[idx] for idx in self.slots()]
+            return code + jump_table("rax", ctx.new_label(), targets)
+
+        def search(node):
+            if node[0] == "linear":
+                lines = []
+                for key, idx in node[1]:
+                    lines += self.compare_lines("cmp", key) + [f"    je {entries[idx]}"]
+                return lines + [f"    jmp {default_label}"]
+            _, key, idx, below, above = node
+            below_label = ctx.new_label()
+            lines = self.compare_lines("cmp", key) + [f"    je {entries[idx]}", f"    jb {below_label}"]
+            return lines + search(above) + [f"{below_label}:"] + search(below)
+        cases = sorted((key, idx) for idx, (key, _, _) in enumerate(self.cases))
+        return code + search(self.search_tree(cases))
+
+    def compare_lines(self, mnemonic, key):
+        """`mnemonic rax, key`, going through rdx for keys that don't fit an immediate."""
+        value = wrap_int(key)
+        if fits_imm32(value):
+            return [f"    {mnemonic} rax, {value}"]
+        return [f"    mov rdx, {value}", f"    {mnemonic} rax, rdx"]
+
+    def dispatch_blocks(self, ir):
+        if self.dense:
+            return [ir.new_block()]
+        cases = sorted((key, idx) for idx, (key, _, _) in enumerate(self.cases))
+        def compares(node):
+            if node[0] == "linear":
+                return len(node[1])
+            return 2 + compares(node[3]) + compares(node[4])
+        # Every compare after the first starts a block of its own
+        return [ir.new_block() for _ in range(compares(self.search_tree(cases)) - 1)]
+
+    def lower_dispatch(self, ir, value, blocks, entries, default_block, state):
+        def const(key):
+            return ir.emit("const", BuiltinTypes.UInt, imm=wrap_int(key))
+        if self.dense:
+            index = ir.emit("sub", BuiltinTypes.UInt, [value, const(self.low)]) if self.low else value
+            above = ir.emit("gt", BuiltinTypes.UInt, [index, const(self.span - 1)])
+            ir.branch(above, default_block, blocks[0])
+            ir.start_block(blocks[0], state)
+            ir.switch(index, [default_block if idx is None else entries[idx] for idx in self.slots()])
+            return
+
+        blocks = iter(blocks)
+        def search(node):
+            if node[0] == "linear":
+                for n, (key, idx) in enumerate(node[1]):
+                    last = n == len(node[1]) - 1
+                    next_block = default_block if last else next(blocks)
+                    ir.branch(ir.emit("eq", BuiltinTypes.UInt, [value, const(key)]), entries[idx], next_block)
+                    if not last:
+                        ir.start_block(next_block, state)
+                return
+            _, key, idx, below, above = node
+            compare_block, above_block, below_block = next(blocks), next(blocks), next(blocks)
+            ir.branch(ir.emit("eq", BuiltinTypes.UInt, [value, const(key)]), entries[idx], compare_block)
+            ir.start_block(compare_block, state)
+            ir.branch(ir.emit("lt", BuiltinTypes.UInt, [value, const(key)]), below_block, above_block)
+            ir.start_block(above_block, state)
+            search(above)
+            ir.start_block(below_block, state)
+            search(below)
+        cases = sorted((key, idx) for idx, (key, _, _) in enumerate(self.cases))
+        search(self.search_tree(cases))
+
 class Extern(ASTNode):
     def __init__(self, ext):
         self.ext = ext
@@ -238,6 +1311,9 @@ class Extern(ASTNode):
         ]
         return code;    
     
+    def lower(self, ir):
+        pass
+
     def __str__(self):
         return f"Extern({self.ext})"
 
@@ -253,10 +1329,22 @@ class Call(ASTNode):
         if ctx.stack_depth < self.arg_count:
             raise Exception(f"Stack underflow in Call to {self.func}")
 
+        # The function may print too, so what libsw buffered has to go out first
+        code += ctx.tos_flush()
+        code += ["    push rbp", "    call flush_output", "    pop rbp"]
         for i in reversed(range(self.arg_count)):
-            code.append(f"    pop {arg_regs[i]}")
-            ctx.stack_types.pop()
+            # C gets a string's NUL terminated bytes, its length is dropped
+            string = is_string(ctx.stack_types.pop())
+            if ctx.codegen == "tos":
+                if string:
+                    ctx.tos_pop(code)
+                ctx.tos_pop(code, arg_regs[i])
+            else:
+                if string:
+                    code.append("    add rsp, 8")
+                code.append(f"    pop {arg_regs[i]}")
             ctx.stack_depth -= 1
+        code += ctx.tos_flush()
 
         code.append(f"    push rbp")
         code.append(f"    call {self.func}")
@@ -268,6 +1356,12 @@ class Call(ASTNode):
 
         return code
 
+    def lower(self, ir):
+        args = [ir.pop(f"Call to {self.func}") for _ in range(self.arg_count)]
+        args = [arg.ptr if is_string(arg.type) else arg for arg in reversed(args)]
+        ir.emit("call", func="flush_output")
+        ir.push(ir.emit("call", BuiltinTypes.UInt, args, func=self.func))
+
     def __str__(self):
         return f"Call({self.func}, {self.arg_count})"
 
@@ -283,15 +1377,11 @@ class VarDef(ASTNode):
             ctx.vars = {}
 
         ctx.vars[self.name] = [label, self.size, self.type]
+        ctx.storage.append((label, self.size, self.type, None))
+        return []
 
-        code = [
-            f"    mov rdi, {self.size}",
-            f"    push rbp",
-            f"    call new",
-            f"    pop rbp",
-            f"    mov [{label}], rax"
-        ]
-        return code
+    def lower(self, ir):
+        self.compile(ir.ctx)
 
     def __str__(self):
         return f"VarDef({self.name}, {self.size})"
@@ -304,23 +1394,32 @@ class ArrayDef(ASTNode):
         self.unit_size = unit_size
         self.base_type = base_type
         self.size      = count * unit_size
-
-    def compile(self, ctx):
+        # Value the storage starts out with instead of zero
+        self.init      = None
+
+    def define(self, ctx):
+        """
+        Give the variable its statically allocated storage. Nothing happens at
+        run time, so a definition inside a loop still only has one copy.
+        """
         label = ctx.new_label()
         if not hasattr(ctx, "vars"):
             ctx.vars = {}
         ctx.vars[self.name] = [label, self.size, self.base_type, self.count]
-        code = [
-            f"    mov rdi, {self.size}",
-            "    push rbp",
-            "    call new",
-            "    pop rbp",
-            f"    mov [{label}], rax"
-        ]
-        return code
+        ctx.storage.append((label, self.size, self.base_type, self.init))
+
+    def compile(self, ctx):
+        self.define(ctx)
+        return []
+
+    def lower(self, ir):
+        self.define(ir.ctx)
+        if self.init is not None:
+            ir.fn.initial_values[ir.ctx.vars[self.name][0]] = self.init
 
     def __str__(self):
-        return f"ArrayDef({self.name}[{self.count}], base={self.base_type})"
+        init = f", init={self.init}" if self.init is not None else ""
+        return f"ArrayDef({self.name}[{self.count}], base={self.base_type}{init})"
 
 
 class LoadVar(ASTNode):
@@ -333,8 +1432,42 @@ class LoadVar(ASTNode):
         lbl, size, t, *rest = ctx.vars[self.name]
         ctx.stack_depth  += 1
         ctx.stack_types.append(t)
+        if BuiltinTypes(t) == BuiltinTypes.Char:
+            # Char variables are buffers with their length in the qword before
+            # them, their value is the buffer's address and that length
+            if ctx.codegen == "tos":
+                code = []
+                ptr = ctx.tos_alloc(code)
+                ctx.cached.append(ptr)
+                code += [f"    lea {ptr}, [{lbl}]"]
+                reg = ctx.tos_alloc(code)
+                ctx.cached.append(reg)
+                return code + [f"    mov {reg}, [{lbl} - 8]"]
+            return [f"    lea rax, [{lbl}]", "    push rax", f"    push qword [{lbl} - 8]"]
+        if ctx.codegen == "tos":
+            code = []
+            reg = ctx.tos_alloc(code)
+            ctx.cached.append(reg)
+            return code + [f"    mov {reg}, {self.location(ctx)}"]
+        if self.name in ctx.var_regs:
+            return [f"    push {ctx.var_regs[self.name]}"]
         return [f"    mov rax, [{lbl}]", "    push rax"]
 
+    def location(self, ctx):
+        """Where the variable's value lives right now: a counted loop's register or its slot."""
+        if self.name in ctx.var_regs:
+            return ctx.var_regs[self.name]
+        return f"qword [{ctx.vars[self.name][0]}]"
+
+    def lower(self, ir):
+        if not hasattr(ir.ctx, "vars") or self.name not in ir.ctx.vars:
+            raise Exception(f"Var '{self.name}' not defined")
+        lbl, size, t, *rest = ir.ctx.vars[self.name]
+        if BuiltinTypes(t) == BuiltinTypes.Char:
+            ir.push_string(ir.emit("addr", t, label=lbl), ir.emit("load", BuiltinTypes.UInt, label=lbl, offset=-8))
+        else:
+            ir.push(ir.emit("load", t, label=lbl))
+
     def __str__(self):
         return f"LoadVar({self.name})"
 
@@ -349,17 +1482,26 @@ class LoadVarIdx(ASTNode):
 
         label, size_bits, var_type, *rest = ctx.vars[self.name]
 
-        code = [
-            "    xor rax, rax",
-            f"    mov al, [{label} + {self.idx}]",
-            "    push rax"
-        ]
+        if ctx.opt_level >= 1:
+            code = ctx.tos_flush() + [f"    movzx eax, byte [{label} + {self.idx}]", "    push rax"]
+        else:
+            code = ctx.tos_flush() + [
+                "    xor rax, rax",
+                f"    mov al, [{label} + {self.idx}]",
+                "    push rax"
+            ]
 
+        # A single byte is a number, not a string
         ctx.stack_depth += 1
-        ctx.stack_types.append(var_type)
-        print("indexed variable with type "+ str(var_type))
+        ctx.stack_types.append(BuiltinTypes.UInt)
         return code
 
+    def lower(self, ir):
+        if not hasattr(ir.ctx, "vars") or self.name not in ir.ctx.vars:
+            raise Exception(f"Var '{self.name}' not defined")
+        label, size_bits, var_type, *rest = ir.ctx.vars[self.name]
+        ir.push(ir.emit("loadb", BuiltinTypes.UInt, label=label, offset=self.idx))
+
     def __str__(self):
         return f"LoadVarIdx({self.name}, {self.idx})"
 
@@ -376,20 +1518,75 @@ class StoreVar(ASTNode):
         lbl, size, t, count = ctx.vars[self.name]
         ctx.stack_depth -= 1
         val_type = ctx.stack_types.pop()
-        code = ["    pop rax"]
-        if val_type == BuiltinTypes.InlineString and t == BuiltinTypes.Char:
-            print("memcpy")
-            code += [f"    mov rsi, rax",     # src
-                     f"    mov rdi, [{lbl}]", # dst
-                     f"    mov rdx, {count}",
-                     f"    call memcpy" ]
+        code = []
+        if is_string(val_type):
+            if BuiltinTypes(t) != BuiltinTypes.Char:
+                raise Exception(f"Can't store a string in '{self.name}'")
+            # Copy into the variable's buffer and keep the length copy_str returns
+            if ctx.codegen == "tos":
+                ctx.tos_pop(code, "rdx")
+                ctx.tos_pop(code, "rsi")
+                code += ctx.tos_flush()
+            else:
+                code += ["    pop rdx", "    pop rsi"]
+            code += [f"    lea rdi, [{lbl}]",
+                     f"    mov rcx, {count}",
+                     "    push rbp",
+                     "    call copy_str",
+                     "    pop rbp",
+                     f"    mov [{lbl} - 8], rax"]
+            return code
+        if ctx.codegen == "tos":
+            reg = ctx.tos_pop(code)
         else:
-            code += [f"    mov [{lbl}], rax"]
+            code += ["    pop rax"]
+            reg = "rax"
+        code += [f"    mov [{lbl}], {reg}"]
         return code
 
+    def lower(self, ir):
+        if not hasattr(ir.ctx, "vars") or self.name not in ir.ctx.vars:
+            raise Exception(f"Var '{self.name}' not defined")
+        lbl, size, t, count = ir.ctx.vars[self.name]
+        value = ir.pop("StoreVar")
+        if is_string(value.type):
+            if BuiltinTypes(t) != BuiltinTypes.Char:
+                raise Exception(f"Can't store a string in '{self.name}'")
+            dst = ir.emit("addr", BuiltinTypes.UInt, label=lbl)
+            capacity = ir.emit("const", BuiltinTypes.UInt, imm=count)
+            length = ir.emit("call", BuiltinTypes.UInt, [dst, value.ptr, value.length, capacity], func="copy_str")
+            ir.emit("store", args=[length], label=lbl, offset=-8)
+        else:
+            ir.emit("store", args=[value], label=lbl)
+
     def __str__(self):
         return f"StoreVar({self.name})"
 
+class UpdateVar(ASTNode):
+    """
+    `name n <op> set name` on one variable, which the direct emitters turn
+    into a single read-modify-write of the variable's slot or register.
+    """
+    def __init__(self, name, op, value):
+        self.name = name
+        self.op = op
+        self.value = value
+
+    def compile(self, ctx):
+        if not hasattr(ctx, "vars") or self.name not in ctx.vars:
+            raise Exception(f"Var '{self.name}' not defined")
+        if BuiltinTypes(ctx.vars[self.name][2]) != BuiltinTypes.UInt:
+            raise Exception("Binary operations only supported on numbers")
+        loc = LoadVar(self.name).location(ctx)
+        return [f"    {op}" for op in update_in_place(loc, self.op, self.value)]
+
+    def lower(self, ir):
+        BinaryOp(self.op, LoadVar(self.name), Number(self.value)).lower(ir)
+        StoreVar(self.name).lower(ir)
+
+    def __str__(self):
+        return f"UpdateVar({self.name}, {self.op}, {self.value})"
+
 class Bang(ASTNode):
     def compile(self, ctx):
         if ctx.stack_depth == 0 or not ctx.stack_types:
@@ -398,11 +1595,23 @@ class Bang(ASTNode):
         ctx.stack_depth -= 1
         if top_type == BuiltinTypes.UInt:
             code = []
-            code += ["    pop rax", "    test rax, rax", "    sete al", "    movzx rax, al", "    push rax"]
+            if ctx.codegen == "tos":
+                reg = ctx.tos_pop(code)
+                low = reg[1] + "l"
+                code += [f"    test {reg}, {reg}", f"    sete {low}", f"    movzx {reg}, {low}"]
+                ctx.cached.append(reg)
+            else:
+                code += ["    pop rax", "    test rax, rax", "    sete al", "    movzx rax, al", "    push rax"]
             ctx.stack_types.append(BuiltinTypes.UInt)
             ctx.stack_depth += 1
             return code
         raise Exception("Bang operator only supported for numbers")
+    def lower(self, ir):
+        value = ir.pop("Bang")
+        if value.type != BuiltinTypes.UInt:
+            raise Exception("Bang operator only supported for numbers")
+        ir.push(ir.emit("not", BuiltinTypes.UInt, [value]))
+
     def __str__(self):
         return "Bang()"
 
@@ -414,6 +1623,18 @@ class BangWrapper(ASTNode):
         code += self.node.compile(ctx)
         code += Bang().compile(ctx)
         return code
+    def lower(self, ir):
+        self.node.lower(ir)
+        Bang().lower(ir)
+
+    def compile_jump(self, ctx, label, when):
+        return self.node.compile_jump(ctx, label, not when)
+
+    def fold(self):
+        if isinstance(self.node, Number):
+            return Number(int(self.node.value % 2**64 == 0))
+        return self
+
     def __str__(self):
         return f"BangWrapper({self.node})"
 
@@ -422,30 +1643,113 @@ class Loop(ASTNode):
         self.condition = condition
         self.body = body
 
+    def constant_condition(self):
+        """The condition's value if it was folded down to a single constant, else None."""
+        exprs = self.condition.expressions
+        if len(exprs) == 1 and isinstance(exprs[0], Number):
+            return exprs[0].value
+        return None
+
+    def is_infinite(self):
+        value = self.constant_condition()
+        return value is not None and value != 0
+
+    def step(self, name):
+        """Index of the top level `name n + set name` (or `-`) in the body, if there is one."""
+        for idx, node in enumerate(self.body):
+            if isinstance(node, UpdateVar) and node.name == name and node.op in ("+", "-"):
+                return idx
+        return None
+
+    def counted_variable(self, ctx):
+        """
+        The induction variable if this is a counted loop: the condition compares
+        a uint variable against a constant or a variable the body never writes,
+        and the only write to it in the body is a constant step.
+        """
+        exprs = self.condition.expressions
+        cond = exprs[0] if len(exprs) == 1 else None
+        if isinstance(cond, BangWrapper):
+            cond = cond.node
+        if not isinstance(cond, Compare) or not isinstance(cond.left, LoadVar):
+            return None
+        name = cond.left.name
+        if name not in getattr(ctx, "vars", {}) or BuiltinTypes(ctx.vars[name][2]) != BuiltinTypes.UInt:
+            return None
+        nodes = [n for node in self.body for n in walk(node)]
+        written = {n.name for n in nodes if hasattr(n, "name") and not isinstance(n, LoadVar)}
+        if not isinstance(cond.right, Number) and not (isinstance(cond.right, LoadVar) and cond.right.name not in written):
+            return None
+        # Loads read the register, so the step has to be the only other mention of the variable
+        uses = [n for n in nodes if getattr(n, "name", None) == name and not isinstance(n, LoadVar)]
+        if self.step(name) is None or len(uses) != 1:
+            return None
+        return name
+
     def compile(self, ctx):
         code = []
         loop_label = ctx.new_label()
         end_label = ctx.new_label()
 
-        code += [f"{loop_label}:"]        
-        code += self.condition.compile(ctx)
-        if ctx.stack_depth == 0:
-            raise Exception("Stack underflow in Loop condition")
-        code += ["    pop rax"]
-        ctx.stack_depth -= 1
-        ctx.stack_types.pop()
-
-        code += [
-            "    cmp rax, 0",
-            f"    je {end_label}"
-        ]
+        code += ctx.tos_flush()
+        counter = self.counted_variable(ctx) if ctx.opt_level >= 1 else None
+        reg = next((r for r in LOOP_REGS if r not in ctx.var_regs.values()), None)
+        if counter and reg:
+            # Keep the induction variable in a callee saved register for the
+            # whole loop; nothing outside Sweet code can see its slot, so it
+            # only has to be written back once the loop is done
+            lbl = ctx.vars[counter][0]
+            code += [f"    mov {reg}, [{lbl}]"]
+            ctx.var_regs[counter] = reg
+            if reg not in ctx.saved_regs:
+                ctx.saved_regs.append(reg)
+        else:
+            counter = None
+        if ctx.opt_level >= 1:
+            code += ["    align 16"]
+        code += [f"{loop_label}:"]
+        if ctx.opt_level >= 1:
+            if not self.is_infinite():
+                code += self.condition.compile_jump(ctx, end_label, False)
+        else:
+            code += branch_on_top(ctx, self.condition.compile(ctx), end_label, False)
 
         for node in self.body:
             code += node.compile(ctx)
+        code += ctx.tos_flush()
         code += [f"    jmp {loop_label}"]
         code += [f"{end_label}:"]
+        if counter:
+            code += [f"    mov [{ctx.vars[counter][0]}], {reg}"]
+            del ctx.var_regs[counter]
         return code
 
+    def lower(self, ir):
+        state = ir.canonicalize()
+        head = ir.new_block()
+        body = ir.new_block()
+        end = ir.new_block()
+        ir.jump(head)
+
+        ir.start_block(head, state)
+        if ir.ctx.opt_level >= 1 and self.is_infinite():
+            head_state = state
+            ir.jump(body)
+        else:
+            self.condition.lower(ir)
+            cond = ir.truth(ir.pop("Loop condition"))
+            head_state = ir.canonicalize()
+            ir.branch(cond, body, end)
+
+        ir.start_block(body, head_state)
+        for node in self.body:
+            node.lower(ir)
+        if [v.type for v in ir.canonicalize()] != [v.type for v in state]:
+            raise Exception("Loop body must leave the stack as it found it")
+        ir.jump(head)
+
+        ir.start_block(end, head_state)
+
     def __str__(self):
         return f"Loop({self.condition}, {self.body})"
     
@@ -459,6 +1763,16 @@ class BlockExpr(ASTNode):
             code += expr.compile(ctx)
         return code
 
+    def lower(self, ir):
+        for expr in self.expressions:
+            expr.lower(ir)
+
+    def compile_jump(self, ctx, label, when):
+        code = []
+        for expr in self.expressions[:-1]:
+            code += expr.compile(ctx)
+        return code + self.expressions[-1].compile_jump(ctx, label, when)
+
     def __str__(self):
         return f"BlockExpr({self.expressions})"
 
@@ -475,6 +1789,11 @@ class Parser:
             raise ParserError(f"Expected {type_}, got {self.current_token.type}",
                               self.current_token.line, self.current_token.column)
 
+    def fold(self, node):
+        if self.ctx.opt_level >= 1:
+            return node.fold()
+        return node
+
     def parse_block(self, until_keywords):
         block_stack = []
         while self.current_token.type != TokenType.EOF:
@@ -487,7 +1806,7 @@ class Parser:
                 node = Number(tok.value)
                 if self.current_token.type == TokenType.BANG:
                     self.eat(TokenType.BANG)
-                    node = BangWrapper(node)
+                    node = self.fold(BangWrapper(node))
                 block_stack.append(node)
 
             elif tok.type in (TokenType.PLUS, TokenType.MINUS, TokenType.STAR, TokenType.SLASH):
@@ -496,23 +1815,35 @@ class Parser:
                     raise ParserError("Not enough operands for binary operator", tok.line, tok.column)
                 right = block_stack.pop()
                 left = block_stack.pop()
-                block_stack.append(BinaryOp(tok.value, left, right))
+                if tok.type == TokenType.SLASH and isinstance(right, Number) and right.value == 0:
+                    raise ParserError("Division by constant zero", tok.line, tok.column)
+                block_stack.append(self.fold(BinaryOp(tok.value, left, right)))
 
             elif tok.type == TokenType.STRING:
                 self.eat(TokenType.STRING)
                 block_stack.append(String(tok.value))
 
-            elif tok.type == TokenType.COMPARE:
-                self.eat(TokenType.COMPARE)
+            elif tok.type in (TokenType.COMPARE, TokenType.LESS, TokenType.GREATER,
+                              TokenType.LESS_EQUAL, TokenType.GREATER_EQUAL):
+                self.eat(tok.type)
                 if len(block_stack) < 2:
                     raise ParserError("Not enough operands for compare operator", tok.line, tok.column)
                 right = block_stack.pop()
                 left = block_stack.pop()
-                block_stack.append(Compare(left, right))
+                if tok.type == TokenType.COMPARE:
+                    block_stack.append(self.fold(Compare(left, right)))
+                else:
+                    block_stack.append(self.fold(Relational(tok.value, left, right)))
 
             elif tok.type == TokenType.BANG:
                 self.eat(TokenType.BANG)
-                block_stack.append(Bang())
+                # A bare bang negates whatever the previous node left on top of
+                # the stack. Code is emitted in the same order either way, so
+                # wrapping that node lets folding and branch fusion see the pair.
+                if self.ctx.opt_level >= 1 and block_stack:
+                    block_stack.append(self.fold(BangWrapper(block_stack.pop())))
+                else:
+                    block_stack.append(Bang())
 
             elif tok.type == TokenType.KEYWORD:
                 if tok.value == "dup":
@@ -541,7 +1872,15 @@ class Parser:
                         self.eat(TokenType.KEYWORD)
                     else:
                         raise ParserError("Expected \"end\" after if block", tok.line, tok.column)
-                    block_stack.append(IfElse(condition, if_body, else_body))
+                    if self.ctx.opt_level >= 1 and isinstance(condition, Number):
+                        # Constant condition: only the branch that's taken survives
+                        block_stack += if_body if condition.value != 0 else (else_body or [])
+                    else:
+                        node = IfElse(condition, if_body, else_body)
+                        if self.ctx.opt_level >= 1:
+                            # Chains testing one variable against constants dispatch without a compare per case
+                            node = StringSwitch.from_chain(node) or IntSwitch.from_chain(node) or node
+                        block_stack.append(node)
                 
                 elif tok.value == "loop":
                     self.eat(TokenType.KEYWORD)
@@ -558,7 +1897,10 @@ class Parser:
                     else:
                         raise ParserError('Expected "end" after loop block', tok.line, tok.column)
 
-                    block_stack.append(Loop(BlockExpr(condition_expr), loop_body))
+                    node = Loop(BlockExpr(condition_expr), loop_body)
+                    # A loop whose condition is constant zero never runs
+                    if not (self.ctx.opt_level >= 1 and node.constant_condition() == 0):
+                        block_stack.append(node)
 
                 elif tok.value == "extern":
                     self.eat(TokenType.KEYWORD)
@@ -609,7 +1951,14 @@ class Parser:
                         raise ParserError("Expected variable name after 'set'", tok.line, tok.column)
                     name = self.current_token.value
                     self.eat(TokenType.IDENTIFIER)
-                    block_stack.append(StoreVar(name))
+                    value = block_stack[-1] if block_stack else None
+                    if (self.ctx.opt_level >= 1 and isinstance(value, BinaryOp)
+                            and isinstance(value.left, LoadVar) and value.left.name == name
+                            and isinstance(value.right, Number)
+                            and update_in_place("rax", value.op, value.right.value) is not None):
+                        block_stack[-1] = UpdateVar(name, value.op, value.right.value)
+                    else:
+                        block_stack.append(StoreVar(name))
                 else:
                     raise ParserError(f"Unexpected keyword: {tok.value}", tok.line, tok.column)
 
@@ -618,14 +1967,20 @@ class Parser:
                 if name in self.ctx.known_externs:
                     self.eat(TokenType.IDENTIFIER)
                     arg_count = self.ctx.known_externs[name]
-                    block_stack.append(Call(name, arg_count))
+                    node = Call(name, arg_count)
+                    if self.ctx.opt_level >= 1 and 0 < arg_count <= len(block_stack):
+                        # printf with a literal format is parsed here instead of at every call
+                        special = FormattedPrint.from_call(node, block_stack[-arg_count:])
+                        if special:
+                            del block_stack[-arg_count:]
+                            node = special
+                    block_stack.append(node)
                 elif name in self.ctx.known_vars:
                     self.eat(TokenType.IDENTIFIER)
                     if self.current_token.type == TokenType.LBRACK:
                         self.eat(TokenType.LBRACK)
                         idx = self.current_token.value
                         self.eat(TokenType.INTLIT)
-                        print(f"Accessing variable {name} at idx {idx}")
                         self.eat(TokenType.RBRACK)
                         block_stack.append(LoadVarIdx(name, idx))
                     else:
@@ -636,7 +1991,43 @@ class Parser:
             else:
                 raise ParserError(f"Unexpected token {tok}", tok.line, tok.column)
 
+        if self.ctx.opt_level >= 1:
+            block_stack = coalesce_prints(block_stack)
+            # Nothing after a loop that never exits can run
+            for idx, node in enumerate(block_stack):
+                if isinstance(node, Loop) and node.is_infinite():
+                    return block_stack[:idx + 1]
         return block_stack
 
     def parse(self):
-        return self.parse_block(until_keywords=set())
\ No newline at end of file
+        program = self.parse_block(until_keywords=set())
+        if self.ctx.opt_level >= 1:
+            program = self.static_initializers(program)
+        return program
+
+    def static_initializers(self, program):
+        """
+        Top level statements run exactly once, so `var x as uint n set x` or
+        `var s as char[n] "text" set s` right after the definition can be the
+        storage's initial value instead of a store or copy at run time.
+        """
+        result = []
+        idx = 0
+        while idx < len(program):
+            node = program[idx]
+            rest = program[idx + 1:idx + 3]
+            if (isinstance(node, ArrayDef) and len(rest) == 2
+                    and isinstance(rest[1], StoreVar) and rest[1].name == node.name):
+                base = BuiltinTypes(node.base_type)
+                if base == BuiltinTypes.UInt and isinstance(rest[0], Number):
+                    node.init = rest[0].value
+                elif base == BuiltinTypes.Char and isinstance(rest[0], String):
+                    # Same bytes copy_str would have left in the buffer
+                    node.init = string_bytes(rest[0].value)[:node.count]
+                if node.init is not None:
+                    result.append(node)
+                    idx += 3
+                    continue
+            result.append(node)
+            idx += 1
+        return result
\ No newline at end of file
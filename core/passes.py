@@ -0,0 +1,310 @@
+import time
+
+from core.ir import Instr, PURE_OPS
+from core.parser import BuiltinTypes
+
+class Pass:
+    name = "pass"
+
+    def run(self, fn):
+        raise NotImplementedError
+
+class PassStats:
+    def __init__(self, name, seconds, before, after):
+        self.name = name
+        self.seconds = seconds
+        self.before = before
+        self.after = after
+
+    def __str__(self):
+        delta = self.after - self.before
+        return (f"{self.name:<28} {self.seconds * 1000:8.3f} ms  "
+                f"{self.before:5} -> {self.after:5} instructions ({delta:+})")
+
+class PassManager:
+    """Runs an ordered list of passes over a function and records what each one bought."""
+    def __init__(self, passes):
+        self.passes = passes
+        self.stats = []
+
+    def run(self, fn):
+        for p in self.passes:
+            before = fn.instr_count()
+            start = time.perf_counter()
+            p.run(fn)
+            elapsed = time.perf_counter() - start
+            self.stats.append(PassStats(p.name, elapsed, before, fn.instr_count()))
+        return fn
+
+    def report(self):
+        return [str(s) for s in self.stats]
+
+def defs_and_uses(fn):
+    defs, uses = {}, {}
+    for block in fn.blocks:
+        for instr in block.instrs:
+            if instr.dst:
+                defs.setdefault(instr.dst, []).append(instr)
+            for arg in instr.args:
+                uses[arg] = uses.get(arg, 0) + 1
+    return defs, uses
+
+def predecessors(fn):
+    preds = {b: [] for b in fn.blocks}
+    for block in fn.blocks:
+        for succ in block.successors():
+            preds[succ].append(block)
+    return preds
+
+def dominators(fn):
+    """Map every block to the set of blocks that dominate it."""
+    preds = predecessors(fn)
+    entry = fn.blocks[0]
+    dom = {b: set(fn.blocks) for b in fn.blocks}
+    dom[entry] = {entry}
+    changed = True
+    while changed:
+        changed = False
+        for block in fn.blocks[1:]:
+            new = {block} | set.intersection(*(dom[p] for p in preds[block])) if preds[block] else {block}
+            if new != dom[block]:
+                dom[block] = new
+                changed = True
+    return dom
+
+def natural_loops(fn):
+    """Map every loop header to the blocks of its loop, found from the back edges into it."""
+    dom = dominators(fn)
+    preds = predecessors(fn)
+    loops = {}
+    for block in fn.blocks:
+        for head in block.successors():
+            if head not in dom[block]:
+                continue
+            body = loops.setdefault(head, {head})
+            work = [block]
+            while work:
+                b = work.pop()
+                if b not in body:
+                    body.add(b)
+                    work += preds[b]
+    return loops
+
+class PromoteVariables(Pass):
+    """
+    Keeps variables that are only ever read and written as a whole qword in
+    a virtual register instead of their .bss slot, so the register allocator
+    can hold them in a register across loops. Loads that are consumed before
+    the variable changes again read the variable's register directly.
+    Accesses at an offset, like a char variable's length, leave the
+    variable in memory.
+    """
+    name = "promote-variables"
+
+    def run(self, fn):
+        accesses, escaped = {}, set()
+        for block in fn.blocks:
+            for instr in block.instrs:
+                if instr.op in ("load", "store") and not instr.offset:
+                    accesses.setdefault(instr.label, []).append(instr)
+                elif instr.label is not None:
+                    escaped.add(instr.label)
+
+        promoted = {}
+        for label, instrs in accesses.items():
+            if label in escaped:
+                continue
+            loads = [i for i in instrs if i.op == "load"]
+            var = fn.new_vreg(loads[0].dst.type if loads else BuiltinTypes.UInt)
+            promoted[label] = var
+            for instr in instrs:
+                if instr.op == "load":
+                    instr.op, instr.args = "mov", [var]
+                else:
+                    instr.op, instr.dst = "mov", var
+                instr.label = None
+        if not promoted:
+            return
+
+        # The registers start out with whatever the static storage would have held
+        fn.blocks[0].instrs[:0] = [Instr("const", var, imm=fn.initial_values.get(label, 0))
+                                   for label, var in promoted.items()]
+        self.forward_loads(fn, set(promoted.values()))
+
+    def forward_loads(self, fn, variables):
+        defs, _ = defs_and_uses(fn)
+        use_blocks = {}
+        for block in fn.blocks:
+            for instr in block.instrs:
+                for arg in instr.args:
+                    use_blocks.setdefault(arg, set()).add(block)
+
+        for block in fn.blocks:
+            replace = {}
+            for idx, instr in enumerate(block.instrs):
+                instr.args = [replace.get(a, a) for a in instr.args]
+                if (instr.op != "mov" or instr.args[0] not in variables
+                        or len(defs[instr.dst]) != 1 or use_blocks.get(instr.dst, set()) - {block}):
+                    continue
+                var = instr.args[0]
+                rest = block.instrs[idx + 1:]
+                last_use = max((n for n, i in enumerate(rest) if instr.dst in i.args), default=-1)
+                if all(i.dst is not var for i in rest[:last_use + 1]):
+                    replace[instr.dst] = var
+            block.instrs = [i for i in block.instrs
+                            if not (i.op == "mov" and (i.dst in replace or i.dst is i.args[0]))]
+
+class CopyPropagation(Pass):
+    """Forwards `mov` sources into uses when both sides are only ever defined once."""
+    name = "copy-propagation"
+
+    def run(self, fn):
+        defs, _ = defs_and_uses(fn)
+        replace = {}
+        for dst, instrs in defs.items():
+            if len(instrs) != 1 or instrs[0].op != "mov":
+                continue
+            src = instrs[0].args[0]
+            if len(defs.get(src, [])) == 1:
+                replace[dst] = src
+        if not replace:
+            return
+        def resolve(v):
+            while v in replace:
+                v = replace[v]
+            return v
+        for block in fn.blocks:
+            for instr in block.instrs:
+                instr.args = [resolve(a) for a in instr.args]
+
+class BranchFolding(Pass):
+    """
+    Branches on a negated value branch on the value itself with the targets
+    swapped, and branches on a constant become plain jumps.
+    """
+    name = "branch-folding"
+
+    def run(self, fn):
+        defs, uses = defs_and_uses(fn)
+        for block in fn.blocks:
+            term = block.terminator
+            while term and term.op == "br":
+                cond = term.args[0]
+                if len(defs.get(cond, [])) != 1:
+                    break
+                instr = defs[cond][0]
+                if instr.op == "const":
+                    target = term.targets[0] if instr.imm != 0 else term.targets[1]
+                    block.instrs[-1] = term = Instr("jmp", targets=[target])
+                elif instr.op == "not" and uses[cond] == 1 and instr in block.instrs:
+                    value = instr.args[0]
+                    after = block.instrs[block.instrs.index(instr) + 1:]
+                    if any(i.dst is value for i in after):
+                        break
+                    term.args = [value]
+                    term.targets.reverse()
+                    uses[value] = uses.get(value, 0) + 1
+                else:
+                    break
+
+class LoopInvariantCodeMotion(Pass):
+    """
+    Moves side effect free instructions whose operands don't change inside a
+    loop into the block that enters it. Loads are invariant when the loop
+    never stores to their variable; reads of char buffers also need a loop
+    without calls, since copy_str writes those.
+    Constants only move along with an instruction that needs them, on their
+    own they're as cheap as a register.
+    """
+    name = "loop-invariant-code-motion"
+
+    def run(self, fn):
+        preds = predecessors(fn)
+        # Innermost loops first, so what they hoist can move further out
+        for head, body in sorted(natural_loops(fn).items(), key=lambda l: len(l[1])):
+            entries = [p for p in preds[head] if p not in body]
+            if len(entries) != 1 or entries[0].successors() != [head]:
+                continue
+            self.hoist(fn, [b for b in fn.blocks if b in body], entries[0])
+
+    def hoist(self, fn, body, preheader):
+        defs, _ = defs_and_uses(fn)
+        stored = {i.label for b in body for i in b.instrs if i.op == "store"}
+        calls = any(i.op == "call" for b in body for i in b.instrs)
+        defined = {i.dst for b in body for i in b.instrs if i.dst}
+        moved = []
+        def invariant(v):
+            if v not in defined:
+                return True
+            return len(defs[v]) == 1 and (defs[v][0] in moved or defs[v][0].op == "const")
+
+        changed = True
+        while changed:
+            changed = False
+            for block in body:
+                for instr in block.instrs:
+                    if (instr.op not in PURE_OPS or instr.op == "const" or instr in moved
+                            or len(defs[instr.dst]) != 1 or not all(invariant(a) for a in instr.args)):
+                        continue
+                    if instr.op in ("load", "loadb") and instr.label in stored:
+                        continue
+                    if instr.op == "loadb" and calls:
+                        continue
+                    for arg in instr.args:
+                        if arg in defined and defs[arg][0] not in moved:
+                            moved.append(defs[arg][0])
+                    moved.append(instr)
+                    changed = True
+        if not moved:
+            return
+        for block in body:
+            block.instrs = [i for i in block.instrs if i not in moved]
+        preheader.instrs[-1:-1] = moved
+
+class DeadCodeElimination(Pass):
+    """Drops side effect free instructions whose result is never read."""
+    name = "dead-code-elimination"
+
+    def run(self, fn):
+        changed = True
+        while changed:
+            changed = False
+            _, uses = defs_and_uses(fn)
+            for block in fn.blocks:
+                kept = [i for i in block.instrs if not (i.is_pure() and i.dst not in uses)]
+                if len(kept) != len(block.instrs):
+                    block.instrs = kept
+                    changed = True
+
+class SimplifyCFG(Pass):
+    """Threads jumps through empty blocks and removes blocks that can't be reached."""
+    name = "simplify-cfg"
+
+    def run(self, fn):
+        def forward(block):
+            seen = set()
+            while (len(block.instrs) == 1 and block.instrs[0].op == "jmp"
+                   and block not in seen):
+                seen.add(block)
+                block = block.instrs[0].targets[0]
+            return block
+        for block in fn.blocks:
+            term = block.terminator
+            if term:
+                term.targets = [forward(t) for t in term.targets]
+            if term and term.op == "br" and term.targets[0] is term.targets[1]:
+                block.instrs[-1] = type(term)("jmp", targets=[term.targets[0]])
+
+        reachable = set()
+        work = [fn.blocks[0]]
+        while work:
+            block = work.pop()
+            if block in reachable:
+                continue
+            reachable.add(block)
+            work += block.successors()
+        fn.blocks = [b for b in fn.blocks if b in reachable]
+
+def default_passes():
+    return [PromoteVariables(), CopyPropagation(), BranchFolding(), DeadCodeElimination(),
+            LoopInvariantCodeMotion(), SimplifyCFG()]
@@ -0,0 +1,232 @@
+import re
+
+# Canonical 64-bit name for every general purpose register alias
+REG_ALIASES = {}
+# 8- and 16-bit aliases: writing one keeps the rest of the register
+PARTIAL_REGS = set()
+for full, aliases in {
+    "rax": ("eax", "ax", "al", "ah"),
+    "rbx": ("ebx", "bx", "bl", "bh"),
+    "rcx": ("ecx", "cx", "cl", "ch"),
+    "rdx": ("edx", "dx", "dl", "dh"),
+    "rsi": ("esi", "si", "sil"),
+    "rdi": ("edi", "di", "dil"),
+    "rbp": ("ebp", "bp", "bpl"),
+    "rsp": ("esp", "sp", "spl"),
+}.items():
+    REG_ALIASES[full] = full
+    for alias in aliases:
+        REG_ALIASES[alias] = full
+        if not alias.startswith("e"):
+            PARTIAL_REGS.add(alias)
+for n in range(8, 16):
+    for suffix in ("", "d", "w", "b"):
+        REG_ALIASES[f"r{n}{suffix}"] = f"r{n}"
+    PARTIAL_REGS |= {f"r{n}w", f"r{n}b"}
+
+# Instructions that only write their first operand, unless it is a partial register
+WRITE_ONLY = {"mov", "movzx", "movsx", "movsxd", "lea"}
+# Instructions that set the byte they are given from the flags
+SETCC = {"sete", "setne", "setb", "seta", "setbe", "setae",
+         "setl", "setg", "setle", "setge", "setz", "setnz"}
+# Instructions that read and write their first operand
+READ_WRITE = {"add", "sub", "imul", "and", "or", "xor", "shl", "shr", "sar",
+              "inc", "dec", "neg", "not"}
+# Instructions that only read their operands (flags aside)
+READ_ONLY = {"cmp", "test"}
+# Registers sweet_main's caller expects to survive the call
+CALLEE_SAVED = {"rbx", "rbp", "rsp", "r12", "r13", "r14", "r15"}
+
+class Insn:
+    """A single parsed line of NASM text."""
+    def __init__(self, text):
+        self.text = text
+        stripped = text.strip()
+        self.is_comment = stripped == "" or stripped.startswith(";")
+        self.is_label = not self.is_comment and stripped.endswith(":")
+        self.op = None
+        self.operands = []
+        if not self.is_comment and not self.is_label:
+            parts = stripped.split(None, 1)
+            self.op = parts[0]
+            if len(parts) > 1:
+                self.operands = [o.strip() for o in parts[1].split(",")]
+
+    def regs(self, operand):
+        return {REG_ALIASES[w] for w in re.findall(r"[a-z0-9]+", operand) if w in REG_ALIASES}
+
+    def is_stack_op(self):
+        if self.op in ("push", "pop", "call", "ret", "leave"):
+            return True
+        return any("rsp" in self.regs(o) for o in self.operands)
+
+    def is_barrier(self):
+        if self.is_label:
+            return True
+        if self.is_comment:
+            return False
+        return self.is_stack_op() or self.op.startswith("j") or self.reads_writes() is None
+
+    def reads_writes(self):
+        """Return (reads, writes) register sets, or None if unknown."""
+        ops = self.operands
+        if self.op in WRITE_ONLY and len(ops) == 2:
+            dst, src = ops
+            reads = self.regs(src)
+            if "[" in dst:
+                return reads | self.regs(dst), set()
+            if dst in PARTIAL_REGS:
+                return reads | self.regs(dst), self.regs(dst)
+            return reads, self.regs(dst)
+        if self.op in SETCC and len(ops) == 1:
+            # Only ever a byte, so the rest of the register lives on
+            if "[" in ops[0]:
+                return self.regs(ops[0]), set()
+            return self.regs(ops[0]), self.regs(ops[0])
+        if self.op in READ_WRITE and ops:
+            dst = ops[0]
+            reads = set().union(*(self.regs(o) for o in ops))
+            if "[" in dst:
+                return reads, set()
+            return reads, self.regs(dst)
+        if self.op in READ_ONLY:
+            return set().union(*(self.regs(o) for o in ops)), set()
+        if self.op == "cqo":
+            return {"rax"}, {"rdx"}
+        if self.op in ("idiv", "div") and ops:
+            return {"rax", "rdx"} | self.regs(ops[0]), {"rax", "rdx"}
+        return None
+
+    def writes(self, reg):
+        rw = self.reads_writes()
+        return rw is None or reg in rw[1]
+
+def is_plain_operand(operand):
+    """Registers and immediates can be moved around freely; memory can not."""
+    return "[" not in operand
+
+class Peephole:
+    """
+    Cleans up the strict push/pop pairs emitted by the compile() methods.
+    Works on the list of NASM lines for the program body and keeps
+    comments and labels in place.
+    """
+    def __init__(self, lines):
+        self.insns = [Insn(line) for line in lines]
+        self.removed = 0
+
+    def count(self):
+        return sum(1 for i in self.insns if i.op)
+
+    def next_insn(self, idx):
+        idx += 1
+        while idx < len(self.insns) and self.insns[idx].is_comment:
+            idx += 1
+        return idx
+
+    def fold_push_pop(self):
+        changed = False
+        for i, push in enumerate(self.insns):
+            if push.op != "push" or not is_plain_operand(push.operands[0]):
+                continue
+            src = push.operands[0]
+            src_regs = push.regs(src)
+            j = self.next_insn(i)
+            while j < len(self.insns) and not self.insns[j].is_barrier():
+                if any(self.insns[j].writes(r) for r in src_regs):
+                    break
+                j = self.next_insn(j)
+            if j >= len(self.insns) or self.insns[j].op != "pop":
+                continue
+            dst = self.insns[j].operands[0]
+            if not is_plain_operand(dst):
+                continue
+            self.insns[i] = Insn("")
+            if dst == src:
+                self.insns[j] = Insn("")
+            else:
+                self.insns[j] = Insn(f"    mov {dst}, {src}")
+            changed = True
+        return changed
+
+    def dead_after(self, idx, reg):
+        idx = self.next_insn(idx)
+        while idx < len(self.insns):
+            insn = self.insns[idx]
+            if insn.op == "ret":
+                return reg not in CALLEE_SAVED
+            if insn.op == "push":
+                if reg in insn.regs(insn.operands[0]):
+                    return False
+            elif insn.op == "pop":
+                # pop qword [reg] reads reg, only pop reg overwrites it
+                dst = insn.operands[0]
+                if REG_ALIASES.get(dst) == reg:
+                    return True
+                if reg in insn.regs(dst):
+                    return False
+            else:
+                rw = None if insn.is_barrier() else insn.reads_writes()
+                if rw is None:
+                    return False
+                if reg in rw[0]:
+                    return False
+                if reg in rw[1]:
+                    return True
+            idx = self.next_insn(idx)
+        return False
+
+    def drop_dead_moves(self):
+        changed = False
+        for i, insn in enumerate(self.insns):
+            if insn.op != "mov" or not is_plain_operand(insn.operands[0]):
+                continue
+            dst = insn.regs(insn.operands[0])
+            if len(dst) == 1 and self.dead_after(i, dst.pop()):
+                self.insns[i] = Insn("")
+                changed = True
+        return changed
+
+    def fold_dup(self):
+        changed = False
+        for i, insn in enumerate(self.insns):
+            if insn.op != "pop" or insn.operands != ["rax"]:
+                continue
+            j = self.next_insn(i)
+            k = self.next_insn(j)
+            if k >= len(self.insns):
+                continue
+            if self.insns[j].text.strip() != "push rax" or self.insns[k].text.strip() != "push rax":
+                continue
+            if not self.dead_after(k, "rax"):
+                continue
+            self.insns[i] = Insn("    push qword [rsp]")
+            self.insns[j] = Insn("")
+            self.insns[k] = Insn("")
+            changed = True
+        return changed
+
+    def fold_cleanup(self):
+        for i, insn in enumerate(self.insns):
+            if insn.op != "ret":
+                continue
+            pops = []
+            j = i - 1
+            while j >= 0 and (self.insns[j].is_comment or self.insns[j].text.strip() == "pop rax"):
+                if self.insns[j].op:
+                    pops.append(j)
+                j -= 1
+            if not pops:
+                continue
+            for p in pops:
+                self.insns[p] = Insn("")
+            self.insns[pops[-1]] = Insn(f"    add rsp, {8 * len(pops)}")
+
+    def run(self):
+        before = self.count()
+        while self.fold_push_pop() or self.drop_dead_moves():
+            pass
+        self.fold_dup()
+        self.fold_cleanup()
+        self.removed = before - self.count()
+        return [i.text for i in self.insns if i.text != ""]
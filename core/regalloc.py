@@ -0,0 +1,119 @@
+# Registers handed out by the allocator. rax and rdx are kept back as
+# scratch: rax carries return values, setcc results and memory to memory
+# moves, rdx is clobbered by cqo/idiv.
+CALLER_SAVED = ["rsi", "rdi", "rcx", "r8", "r9", "r10", "r11"]
+CALLEE_SAVED = ["rbx", "r12", "r13", "r14", "r15"]
+
+class Interval:
+    def __init__(self, vreg):
+        self.vreg = vreg
+        self.start = None
+        self.end = None
+        self.reg = None
+        self.crosses_call = False
+
+    def extend(self, pos):
+        if self.start is None or pos < self.start:
+            self.start = pos
+        if self.end is None or pos > self.end:
+            self.end = pos
+
+    def __str__(self):
+        where = self.reg or "spill"
+        return f"{self.vreg} [{self.start}, {self.end}] -> {where}"
+
+class LinearScan:
+    """
+    Poletto & Sarkar style linear scan over the block layout order. Each
+    virtual register gets a single live interval covering every position
+    it's live at, holes included. Intervals that live across a call are
+    only ever given callee saved registers, so nothing has to be saved
+    around Call or the runtime helpers and the argument registers are free
+    for argument setup.
+    """
+    def __init__(self, fn):
+        self.fn = fn
+        self.intervals = {}
+        self.calls = []
+        self.assignment = {}
+        self.used_callee_saved = []
+
+    def liveness(self):
+        gen, kill = {}, {}
+        for block in self.fn.blocks:
+            g, k = set(), set()
+            for instr in block.instrs:
+                g |= {a for a in instr.args if a not in k}
+                if instr.dst:
+                    k.add(instr.dst)
+            gen[block], kill[block] = g, k
+
+        live_in = {b: set() for b in self.fn.blocks}
+        live_out = {b: set() for b in self.fn.blocks}
+        changed = True
+        while changed:
+            changed = False
+            for block in reversed(self.fn.blocks):
+                out = set().union(*(live_in[s] for s in block.successors()))
+                new_in = gen[block] | (out - kill[block])
+                if out != live_out[block] or new_in != live_in[block]:
+                    live_out[block], live_in[block] = out, new_in
+                    changed = True
+        return live_in, live_out
+
+    def build_intervals(self):
+        live_in, live_out = self.liveness()
+        pos = 0
+        for block in self.fn.blocks:
+            # Block entry gets its own position so live-in values never share
+            # a register with something that dies in the first instruction
+            start = pos
+            pos += 2
+            for instr in block.instrs:
+                for v in instr.args + ([instr.dst] if instr.dst else []):
+                    self.intervals.setdefault(v, Interval(v)).extend(pos)
+                if instr.op == "call":
+                    self.calls.append(pos)
+                pos += 2
+            end = pos - 2
+            for v in live_in[block]:
+                self.intervals.setdefault(v, Interval(v)).extend(start)
+            for v in live_out[block]:
+                self.intervals.setdefault(v, Interval(v)).extend(end)
+
+        for it in self.intervals.values():
+            it.crosses_call = any(it.start < p < it.end for p in self.calls)
+
+    def allocate(self):
+        self.build_intervals()
+        active = []
+        free = CALLER_SAVED + CALLEE_SAVED
+        for it in sorted(self.intervals.values(), key=lambda i: (i.start, i.end)):
+            # Intervals ending where this one starts are read by the defining
+            # instruction, so their register can be reused for the result
+            for old in [a for a in active if a.end <= it.start]:
+                active.remove(old)
+                free.append(old.reg)
+
+            allowed = CALLEE_SAVED if it.crosses_call else CALLER_SAVED + CALLEE_SAVED
+            choice = next((r for r in allowed if r in free), None)
+            if choice is not None:
+                free.remove(choice)
+                it.reg = choice
+                active.append(it)
+                continue
+
+            # Out of registers: spill whichever compatible interval lives longest
+            victims = [a for a in active if a.reg in allowed and a.end > it.end]
+            if victims:
+                victim = max(victims, key=lambda a: a.end)
+                it.reg, victim.reg = victim.reg, None
+                active.remove(victim)
+                active.append(it)
+
+        for it in self.intervals.values():
+            self.assignment[it.vreg] = it.reg
+            if it.reg in CALLEE_SAVED and it.reg not in self.used_callee_saved:
+                self.used_callee_saved.append(it.reg)
+        self.used_callee_saved.sort(key=CALLEE_SAVED.index)
+        return self.assignment
@@ -0,0 +1,327 @@
+from core.parser import (CONDITION_CODES, COMPARE_OPS, NEGATED_CONDITIONS,
+                         fits_imm32, multiply_by_const, divide_by_const, update_in_place,
+                         string_hash, jump_table)
+from core.regalloc import LinearScan
+
+ARG_REGS = ["rdi", "rsi", "rdx", "rcx", "r8", "r9"]
+# Sweet operator for each IR arithmetic instruction
+BINARY_OPS = {"add": "+", "sub": "-", "mul": "*"}
+# Condition code set by each IR compare
+SETCC = {ir_op: CONDITION_CODES[op] for op, ir_op in COMPARE_OPS.items()}
+
+class X86Backend:
+    """
+    Lowers an IR function to NASM for x86_64 System V. Virtual registers
+    live wherever the linear scan allocator put them; the ones it couldn't
+    fit get a qword in the stack frame. rax and rdx are scratch.
+    """
+    def __init__(self, fn):
+        self.fn = fn
+        self.allocator = LinearScan(fn)
+        self.regs = self.allocator.allocate()
+        self.saved = self.allocator.used_callee_saved
+        self.slots = {}
+        self.code = []
+        self.tables = 0
+        self.fused = self.find_fused_compares()
+        self.consts, self.inlined = self.find_immediates()
+        self.uses = {}
+        for block in fn.blocks:
+            for instr in block.instrs:
+                for arg in instr.args:
+                    self.uses[arg] = self.uses.get(arg, 0) + 1
+
+    def read_modify_write(self, instrs, idx):
+        """
+        Lower `t = op v, imm; v = mov t` (v a variable's register) or
+        `t1 = load [x]; t2 = op t1, imm; store t2, [x]` as a single
+        instruction on v or [x]. Returns how many instructions that took.
+        Constants that are only used as immediates emit nothing, so they
+        don't get in the way.
+        """
+        instr = instrs[idx]
+        following = [n for n in range(idx + 1, len(instrs))
+                     if not (instrs[n].op == "const" and instrs[n].dst in self.inlined)]
+        rest = [instrs[n] for n in following]
+        if instr.op == "load" and len(rest) >= 2:
+            update, store = rest[0], rest[1]
+            if (store.op == "store" and store.label == instr.label and store.args == [update.dst]
+                    and update.args[:1] == [instr.dst] and self.uses[instr.dst] == 1
+                    and self.uses[update.dst] == 1):
+                ops = self.update_ops(update, f"qword [{instr.label}]")
+                if ops is not None:
+                    for line in ops:
+                        self.emit(line)
+                    return following[1] + 1 - idx
+        if instr.op in BINARY_OPS and rest:
+            copy = rest[0]
+            if copy.op == "mov" and copy.args == [instr.dst] and copy.dst is instr.args[0] and self.uses[instr.dst] == 1:
+                ops = self.update_ops(instr, self.loc(copy.dst))
+                if ops is not None:
+                    for line in ops:
+                        self.emit(line)
+                    return following[0] + 1 - idx
+        return 0
+
+    def update_ops(self, instr, loc):
+        if instr.op not in BINARY_OPS or len(instr.args) != 2:
+            return None
+        value = self.immediate(instr, 1)
+        if value is None:
+            return None
+        return update_in_place(loc, BINARY_OPS[instr.op], value)
+
+    def find_immediates(self):
+        """
+        Registers that always hold the same constant, and the constants that
+        never need a register because every use encodes them as an immediate.
+        """
+        defs, uses, immediate_uses = {}, {}, {}
+        for block in self.fn.blocks:
+            for instr in block.instrs:
+                if instr.dst:
+                    defs.setdefault(instr.dst, []).append(instr)
+                for arg in instr.args:
+                    uses[arg] = uses.get(arg, 0) + 1
+        consts = {v: d[0].imm for v, d in defs.items() if len(d) == 1 and d[0].op == "const"}
+        self.consts = consts
+        for block in self.fn.blocks:
+            for instr in block.instrs:
+                for idx, arg in enumerate(instr.args):
+                    if self.immediate(instr, idx) is not None:
+                        immediate_uses[arg] = immediate_uses.get(arg, 0) + 1
+        inlined = {v for v in consts if uses.get(v, 0) and immediate_uses.get(v, 0) == uses[v]}
+        return consts, inlined
+
+    def immediate(self, instr, idx):
+        """The constant instr's idx-th argument gets encoded as, or None if it's read from its location."""
+        value = self.consts.get(instr.args[idx])
+        if value is None:
+            return None
+        op = instr.op
+        if op == "call":
+            return value
+        if op in ("mov", "store"):
+            return value if fits_imm32(value) else None
+        if idx != 1:
+            return None
+        if op in ("add", "sub") or op in SETCC:
+            return value if fits_imm32(value) else None
+        if op == "mul":
+            return value if multiply_by_const("rax", value) is not None else None
+        if op == "div":
+            return value if value % 2**64 else None
+        return None
+
+    def find_fused_compares(self):
+        """Compares whose only use is the branch right after them, which can branch on the flags."""
+        uses = {}
+        for block in self.fn.blocks:
+            for instr in block.instrs:
+                for arg in instr.args:
+                    uses[arg] = uses.get(arg, 0) + 1
+        fused = {}
+        for block in self.fn.blocks:
+            if len(block.instrs) < 2:
+                continue
+            cmp, term = block.instrs[-2], block.instrs[-1]
+            if cmp.op in SETCC and term.op == "br" and term.args[0] is cmp.dst and uses[cmp.dst] == 1:
+                fused[cmp.dst] = SETCC[cmp.op]
+        return fused
+
+    def loc(self, vreg):
+        if self.regs.get(vreg):
+            return self.regs[vreg]
+        if vreg not in self.slots:
+            offset = 8 * (len(self.saved) + len(self.slots) + 1)
+            self.slots[vreg] = f"qword [rbp - {offset}]"
+        return self.slots[vreg]
+
+    def emit(self, line):
+        self.code.append(f"    {line}")
+
+    def address(self, instr):
+        """The memory operand of a load or store, without the brackets."""
+        if not instr.offset:
+            return instr.label
+        return f"{instr.label} {'-' if instr.offset < 0 else '+'} {abs(instr.offset)}"
+
+    def move(self, dst, src):
+        """Move between two locations, going through rax when both are in memory."""
+        if dst == src:
+            return
+        if "[" in dst and "[" in src:
+            self.emit(f"mov rax, {src}")
+            src = "rax"
+        self.emit(f"mov {dst}, {src}")
+
+    def parallel_move(self, moves):
+        """Emit register moves that all read their sources before any destination is written."""
+        moves = [(d, s) for d, s in moves if d != s]
+        while moves:
+            sources = {s for _, s in moves}
+            ready = next((m for m in moves if m[0] not in sources), None)
+            if ready:
+                self.move(*ready)
+                moves.remove(ready)
+                continue
+            # Every destination is still needed as a source: break the cycle through rax
+            blocked = moves[0][0]
+            self.emit(f"mov rax, {blocked}")
+            moves = [(d, "rax" if s == blocked else s) for d, s in moves]
+
+    def lower_instr(self, instr, next_block):
+        op = instr.op
+        dst = self.loc(instr.dst) if instr.dst else None
+        args = [self.loc(a) for a in instr.args]
+        imms = [self.immediate(instr, idx) for idx in range(len(args))]
+        args = [str(imm) if imm is not None else arg for arg, imm in zip(args, imms)]
+        if op == "const":
+            if instr.dst in self.inlined:
+                return
+            if -2**31 <= instr.imm < 2**31:
+                self.emit(f"mov {dst}, {instr.imm}")
+            else:
+                self.emit(f"mov rax, {instr.imm}")
+                self.move(dst, "rax")
+        elif op == "addr":
+            reg = dst if "[" not in dst else "rax"
+            self.emit(f"lea {reg}, [{instr.label}]")
+            self.move(dst, reg)
+        elif op == "load":
+            reg = dst if "[" not in dst else "rax"
+            self.emit(f"mov {reg}, [{self.address(instr)}]")
+            self.move(dst, reg)
+        elif op == "loadb":
+            reg = dst if "[" not in dst else "rax"
+            self.emit(f"movzx {reg}, byte [{self.address(instr)}]")
+            self.move(dst, reg)
+        elif op == "second":
+            # The call right before left it in rdx, which nothing allocates
+            self.move(dst, "rdx")
+        elif op == "strhash":
+            for line in string_hash(args[0], args[1], instr.offset, instr.imm, instr.bits):
+                self.emit(line)
+            self.move(dst, "rax")
+        elif op == "store":
+            src = args[0]
+            if "[" in src:
+                self.emit(f"mov rax, {src}")
+                src = "rax"
+            self.emit(f"mov qword [{self.address(instr)}], {src}")
+        elif op == "mov":
+            self.move(dst, args[0])
+        elif op == "mul" and imms[1] is not None:
+            reg = dst if "[" not in dst else "rax"
+            self.move(reg, args[0])
+            for line in multiply_by_const(reg, imms[1]):
+                self.emit(line)
+            self.move(dst, reg)
+        elif op == "div" and imms[1] is not None:
+            # dst is never rax or rdx, which the reciprocal multiply needs
+            self.move(dst, args[0])
+            for line in divide_by_const(dst, imms[1]):
+                self.emit(line)
+        elif op in ("add", "sub", "mul"):
+            mnemonic = {"add": "add", "sub": "sub", "mul": "imul"}[op]
+            left, right = args
+            if dst == right and op != "sub":
+                left, right = right, left
+            # imul can't write memory and nothing can clobber the right operand early
+            reg = dst if "[" not in dst and dst != right else "rax"
+            self.move(reg, left)
+            self.emit(f"{mnemonic} {reg}, {right}")
+            self.move(dst, reg)
+        elif op == "div":
+            self.move("rax", args[0])
+            self.emit("xor edx, edx")
+            self.emit(f"div {args[1]}")
+            self.move(dst, "rax")
+        elif op in SETCC:
+            left, right = args
+            if "[" in left and "[" in right:
+                self.emit(f"mov rax, {left}")
+                left = "rax"
+            self.emit(f"cmp {left}, {right}")
+            if instr.dst not in self.fused:
+                self.emit(f"set{SETCC[op]} al")
+                self.emit("movzx rax, al")
+                self.move(dst, "rax")
+        elif op == "not":
+            self.emit(f"cmp {args[0]}, 0")
+            self.emit("sete al")
+            self.emit("movzx rax, al")
+            self.move(dst, "rax")
+        elif op == "call":
+            if len(args) > len(ARG_REGS):
+                raise Exception(f"Too many arguments in call to {instr.func}")
+            self.parallel_move(list(zip(ARG_REGS, args)))
+            self.emit(f"call {instr.func}")
+            if dst:
+                self.move(dst, "rax")
+        elif op == "jmp":
+            if instr.targets[0] is not next_block:
+                self.emit(f"jmp {instr.targets[0].label}")
+        elif op == "br":
+            if_true, if_false = instr.targets
+            if instr.args[0] in self.fused:
+                cc = self.fused[instr.args[0]]
+                jump_true, jump_false = f"j{cc}", f"j{NEGATED_CONDITIONS[cc]}"
+            else:
+                self.emit(f"cmp {args[0]}, 0")
+                jump_true, jump_false = "jne", "je"
+            if if_true is next_block:
+                self.emit(f"{jump_false} {if_false.label}")
+            else:
+                self.emit(f"{jump_true} {if_true.label}")
+                if if_false is not next_block:
+                    self.emit(f"jmp {if_false.label}")
+        elif op == "switch":
+            table = f"{self.fn.name}_table{self.tables}"
+            self.tables += 1
+            index = args[0]
+            if "[" in index:
+                self.emit(f"mov rax, {index}")
+                index = "rax"
+            self.code += jump_table(index, table, [t.label for t in instr.targets])
+        elif op == "ret":
+            if self.saved:
+                self.emit(f"lea rsp, [rbp - {8 * len(self.saved)}]")
+            else:
+                self.emit("mov rsp, rbp")
+            for reg in reversed(self.saved):
+                self.emit(f"pop {reg}")
+            self.emit("pop rbp")
+            self.emit("ret")
+        else:
+            raise Exception(f"Unknown IR instruction {op}")
+
+    def lower(self):
+        blocks = self.fn.blocks
+        # Blocks reached by a backward edge are loop heads, which get aligned
+        # so the loop starts on a fresh fetch block
+        position = {block: idx for idx, block in enumerate(blocks)}
+        loop_heads = {t for block in blocks for t in block.successors() if position[t] <= position[block]}
+        for idx, block in enumerate(blocks):
+            next_block = blocks[idx + 1] if idx + 1 < len(blocks) else None
+            if idx > 0:
+                if block in loop_heads:
+                    self.emit("align 16")
+                self.code.append(f"{block.label}:")
+            idx = 0
+            while idx < len(block.instrs):
+                fused = self.read_modify_write(block.instrs, idx)
+                if not fused:
+                    self.lower_instr(block.instrs[idx], next_block)
+                idx += fused or 1
+
+        # The frame size is only known once every spilled register has a slot,
+        # and has to keep rsp 16 byte aligned at calls
+        prologue = ["    push rbp", "    mov rbp, rsp"]
+        prologue += [f"    push {reg}" for reg in self.saved]
+        frame = 8 * len(self.slots)
+        if (frame + 8 * len(self.saved)) % 16:
+            frame += 8
+        if frame:
+            prologue.append(f"    sub rsp, {frame}")
+        return prologue + self.code
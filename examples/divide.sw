@@ -0,0 +1,17 @@
+/*===============================*/
+/* Sweet constant division       */
+/*===============================*/
+var x as uint 85 set x
+
+// The quotient is added to a value that sits below it on the stack
+7 x 10 / + 15 ? if
+    "7 + 85 / 10 test OK\n"print
+else
+    "7 + 85 / 10 test FAIL\n"print
+end
+
+7 x 3 / + 35 ? if
+    "7 + 85 / 3 test OK\n"print
+else
+    "7 + 85 / 3 test FAIL\n"print
+end
@@ -0,0 +1,8 @@
+/*===============================*/
+/* Sweet escapes across prints   */
+/*===============================*/
+
+// An escape ends where its literal ends, even when prints are merged
+"\52" print "1" print "\n" print    // *1
+"\52" print 7 print "\n" print      // *7
+"\1" print 2 print "A\0" print "7" print "\n" print  // bytes 1, 2, A, 0, 7
@@ -0,0 +1,10 @@
+/*===============================*/
+/* Sweet two input lines         */
+/*===============================*/
+
+// Both lines stay on the stack until they are printed
+"First line: " print input
+"Second line: " print input
+"\nSecond: " print print
+"\nFirst: " print print
+"\n" print
@@ -2,6 +2,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
 
 #ifdef LIBSW_DEBUG
 #define DEBUG_LOG(fmt, ...) \
@@ -11,6 +18,20 @@
 #endif
 
 #define ARENA_BLOCK_SIZE 4096
+#define OUT_BUFFER_SIZE 65536
+#define IN_BUFFER_SIZE (1 << 20)
+
+/*
+ * A Sweet string is a pointer and a length, which the compiler keeps in two
+ * stack slots and passes to libsw as two arguments. Functions that hand a
+ * string back return both, in rax and rdx. The bytes are NUL terminated as
+ * well, so a string can go to C as it is.
+ */
+typedef struct
+{
+    const char *data;
+    size_t length;
+} SwString;
 
 typedef struct ArenaBlock
 {
@@ -103,44 +124,349 @@ void arena_cleanup(Arena *arena)
     DEBUG_LOG("arena: cleaned up %d blocks", count);
 }
 
-char *stdin_getline(void)
+/*
+ * Everything Sweet prints collects in one buffer that goes out with write(2)
+ * when it fills up, at exit and before extern calls, which may print
+ * through stdio themselves. Like stdio, a terminal gets every complete line
+ * right away.
+ */
+static struct
 {
-    size_t capacity = 64;
-    size_t length = 0;
-    char *buffer = arena_alloc(&global_arena, capacity);
-    if (!buffer)
-        return NULL;
+    size_t used;
+    int line_buffered;
+    char data[OUT_BUFFER_SIZE];
+} out;
 
-    int ch;
-    while ((ch = fgetc(stdin)) != EOF && ch != '\n')
+static void write_all(const char *data, size_t length)
+{
+    while (length)
     {
-        if (length + 1 >= capacity)
+        ssize_t written = write(STDOUT_FILENO, data, length);
+        if (written < 0)
         {
-            size_t new_capacity = capacity * 2;
-            char *new_buffer = arena_alloc(&global_arena, new_capacity);
-            memcpy(new_buffer, buffer, length);
-            buffer = new_buffer;
-            capacity = new_capacity;
+            if (errno == EINTR)
+                continue;
+            DEBUG_LOG("output: write failed, dropping %zu bytes", length);
+            return;
         }
-        buffer[length++] = (char)ch;
+        data += written;
+        length -= written;
     }
+}
 
-    if (length == 0 && ch == EOF)
-        return NULL;
+void flush_output(void)
+{
+    if (!out.used)
+        return;
+    // Whatever an extern left in stdio's buffer was printed first
+    fflush(stdout);
+    write_all(out.data, out.used);
+    out.used = 0;
+}
 
-    buffer[length] = '\0';
-    DEBUG_LOG("stdin_getline: read \"%s\"", buffer);
-    return buffer;
+static void out_write(const char *data, size_t length)
+{
+    if (length > OUT_BUFFER_SIZE - out.used)
+    {
+        flush_output();
+        if (length >= OUT_BUFFER_SIZE)
+        {
+            fflush(stdout);
+            write_all(data, length);
+            return;
+        }
+    }
+    memcpy(out.data + out.used, data, length);
+    out.used += length;
+    if (out.line_buffered && memchr(data, '\n', length))
+        flush_output();
+}
+
+static void out_init(void)
+{
+    out.line_buffered = isatty(STDOUT_FILENO);
+    atexit(flush_output);
+    DEBUG_LOG("output: %s buffered", out.line_buffered ? "line" : "fully");
+}
+
+/*
+ * Integer formatting writes straight into the output buffer, two digits at
+ * a time from a table, after working out how many digits there are from
+ * the number's bit length.
+ */
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const uint64_t powers_of_10[20] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+    100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+    10000000000000ULL, 100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL};
+
+static int digit_count(uint64_t n)
+{
+    // 1233 / 4096 is just above log10(2), so the guess is the count or one less
+    int bits = 64 - __builtin_clzll(n | 1);
+    int guess = (bits * 1233) >> 12;
+    return guess + ((n | 1) >= powers_of_10[guess]);
+}
+
+static void format_decimal(char *dst, uint64_t n, int digits)
+{
+    char *p = dst + digits;
+    while (n >= 100)
+    {
+        unsigned pair = (unsigned)(n % 100) * 2;
+        n /= 100;
+        p -= 2;
+        memcpy(p, digit_pairs + pair, 2);
+    }
+    if (n >= 10)
+        memcpy(p - 2, digit_pairs + n * 2, 2);
+    else
+        p[-1] = (char)('0' + n);
+}
+
+// Longest number print_int can produce: "-9223372036854775808"
+#define MAX_DECIMAL 20
+
+static int out_decimal(uint64_t n, int negative)
+{
+    if (OUT_BUFFER_SIZE - out.used < MAX_DECIMAL)
+        flush_output();
+    char *dst = out.data + out.used;
+    if (negative)
+        *dst++ = '-';
+    int digits = digit_count(n);
+    format_decimal(dst, n, digits);
+    out.used += negative + digits;
+    return negative + digits;
+}
+
+void print_uint(uint64_t val)
+{
+    out_decimal(val, 0);
 }
 
 void print_int(long val)
 {
-    printf("%ld", val);
+    out_decimal(val < 0 ? 0 - (uint64_t)val : (uint64_t)val, val < 0);
+}
+
+void print_str(const char *str, size_t length)
+{
+    out_write(str, length);
 }
 
-void print_str(unsigned long size, const char *str)
+/*
+ * A run of prints the compiler merged into one call, like writev(2) but
+ * into the output buffer: each part is a string and its length, or an
+ * integer in the pointer half with one of the SW_PART_* lengths saying how
+ * to format it. Returns the bytes printed, so it can stand in for printf.
+ */
+#define SW_PART_UINT ((size_t)-1)
+#define SW_PART_INT ((size_t)-2)
+#define SW_PART_INT32 ((size_t)-3)
+#define SW_PART_UINT32 ((size_t)-4)
+
+typedef struct
+{
+    const char *data;
+    size_t length;
+} PrintPart;
+
+size_t print_parts(const PrintPart *parts, size_t count)
 {
-    printf("%.*s", size, str);
+    size_t printed = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        uint64_t value = (uint64_t)(uintptr_t)parts[i].data;
+        switch (parts[i].length)
+        {
+        case SW_PART_UINT:
+            printed += out_decimal(value, 0);
+            break;
+        case SW_PART_INT:
+            printed += out_decimal((int64_t)value < 0 ? 0 - value : value, (int64_t)value < 0);
+            break;
+        case SW_PART_INT32:
+            value = (uint32_t)value;
+            printed += out_decimal(value >= 0x80000000u ? 0x100000000u - value : value, value >= 0x80000000u);
+            break;
+        case SW_PART_UINT32:
+            printed += out_decimal((uint32_t)value, 0);
+            break;
+        default:
+            out_write(parts[i].data, parts[i].length);
+            printed += parts[i].length;
+            break;
+        }
+    }
+    return printed;
+}
+
+/*
+ * stdin is read with read(2) in large blocks. A line that ends inside a
+ * block is handed to Sweet where it lies, with its newline turned into the
+ * NUL. The program may keep a line on its stack for as long as it likes,
+ * so the compiler tells stdin_getline how many strings the stack holds.
+ * With none, the unread rest of the block moves to its front before the
+ * next read. Otherwise the lines already handed out of the block may still
+ * be in use, so the block is retired untouched and reading goes on in a
+ * fresh one. Retired blocks are freed once the stack holds no strings
+ * again. A block only grows for a line longer than all of it. Nothing
+ * else may read stdin through stdio.
+ */
+typedef struct InputBlock
+{
+    struct InputBlock *next;
+    size_t capacity;
+    char data[];
+} InputBlock;
+
+static struct
+{
+    InputBlock *block;
+    // Blocks lines the program may still hold were handed out of
+    InputBlock *retired;
+    // Unread bytes are block->data[start, end)
+    size_t start;
+    size_t end;
+    int eof;
+} in;
+
+// A block of the given capacity, old's bytes moved into it if old isn't NULL
+static InputBlock *in_block_alloc(InputBlock *old, size_t capacity)
+{
+    // Room for a NUL after the last line
+    InputBlock *block = realloc(old, sizeof(InputBlock) + capacity + 1);
+    if (!block)
+    {
+        fprintf(stderr, "libsw: input buffer allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    block->next = NULL;
+    block->capacity = capacity;
+    return block;
+}
+
+static void in_free_retired(void)
+{
+    while (in.retired)
+    {
+        InputBlock *next = in.retired->next;
+        free(in.retired);
+        in.retired = next;
+    }
+}
+
+static int in_refill(size_t *scanned, size_t live)
+{
+    if (!in.block)
+        in.block = in_block_alloc(NULL, IN_BUFFER_SIZE);
+    size_t unread = in.end - in.start;
+    if (in.start && live)
+    {
+        InputBlock *block = in_block_alloc(NULL, in.block->capacity);
+        memcpy(block->data, in.block->data + in.start, unread);
+        in.block->next = in.retired;
+        in.retired = in.block;
+        in.block = block;
+        DEBUG_LOG("input: block retired, %zu unread bytes carried over", unread);
+    }
+    else if (in.start)
+    {
+        memmove(in.block->data, in.block->data + in.start, unread);
+    }
+    *scanned -= in.start;
+    in.end = unread;
+    in.start = 0;
+    if (in.end == in.block->capacity)
+    {
+        // Nothing was handed out of the block yet, so it's free to move
+        in.block = in_block_alloc(in.block, 2 * in.block->capacity);
+        DEBUG_LOG("input: block grown to %zu bytes", in.block->capacity);
+    }
+
+    ssize_t count;
+    do
+        count = read(STDIN_FILENO, in.block->data + in.end, in.block->capacity - in.end);
+    while (count < 0 && errno == EINTR);
+    if (count <= 0)
+    {
+        in.eof = 1;
+        return 0;
+    }
+    in.end += count;
+    return 1;
+}
+
+#ifndef LIBSW_BENCH
+// The benchmark never reads stdin, so only the normal entry point cleans up
+static void in_cleanup(void)
+{
+    free(in.block);
+    in.block = NULL;
+    in_free_retired();
+}
+#endif
+
+SwString stdin_getline(size_t live)
+{
+    // A prompt on a terminal has to show up before we wait for the answer
+    if (out.line_buffered)
+        flush_output();
+    if (!live)
+        in_free_retired();
+
+    size_t scanned = in.start;
+    char *newline;
+    for (;;)
+    {
+        if (scanned < in.end && (newline = memchr(in.block->data + scanned, '\n', in.end - scanned)))
+            break;
+        scanned = in.end;
+        if (in.eof || !in_refill(&scanned, live))
+        {
+            // End of input is the empty string
+            if (in.start == in.end)
+                return (SwString){"", 0};
+            // The last line has no newline, its NUL goes right after it
+            newline = in.block->data + in.end;
+            break;
+        }
+    }
+
+    char *data = in.block->data;
+    SwString line = {data + in.start, (size_t)(newline - (data + in.start))};
+    *newline = '\0';
+    in.start = newline < data + in.end ? (size_t)(newline - data) + 1 : in.end;
+    DEBUG_LOG("stdin_getline: read \"%s\"", line.data);
+    return line;
+}
+
+/*
+ * Copy a string into a char variable's buffer of `capacity` bytes, cutting
+ * it short if it doesn't fit. The string may be the variable's own value.
+ * Returns the length of what was copied, which the compiler keeps as the
+ * variable's length.
+ */
+size_t copy_str(char *dst, const char *src, size_t length, size_t capacity)
+{
+    if (length > capacity)
+        length = capacity;
+    memmove(dst, src, length);
+    dst[length] = '\0';
+    return length;
 }
 
 uintptr_t compare_int(uintptr_t a, uintptr_t b)
@@ -150,14 +476,104 @@ uintptr_t compare_int(uintptr_t a, uintptr_t b)
     return result;
 }
 
-uintptr_t compare_str(const char *str1, const char *str2)
+/*
+ * Byte equality of two buffers of the same known length, so no NUL scan is
+ * needed. The widest version the CPU supports is picked once at startup.
+ */
+static int bytes_equal_scalar(const char *a, const char *b, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+    {
+        if (a[i] != b[i])
+            return 0;
+    }
+    return 1;
+}
+
+#if defined(__x86_64__)
+static int bytes_equal_sse2(const char *a, const char *b, size_t n)
+{
+    if (n < 16)
+        return bytes_equal_scalar(a, b, n);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xFFFF)
+            return 0;
+    }
+    if (i == n)
+        return 1;
+
+    // The last chunk overlaps the previous one instead of going byte by byte
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + n - 16));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + n - 16));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+}
+
+__attribute__((target("avx2"))) static int bytes_equal_avx2(const char *a, const char *b, size_t n)
 {
-    if (!str1 || !str2)
+    if (n < 32)
+        return bytes_equal_sse2(a, b, n);
+
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32)
+    {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xFFFFFFFFu)
+            return 0;
+    }
+    if (i == n)
+        return 1;
+
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + n - 32));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + n - 32));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) == 0xFFFFFFFFu;
+}
+
+static int cpu_has_avx2(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
         return 0;
-    if (strlen(str1) != strlen(str2))
+    if (!(ecx & bit_OSXSAVE) || !(ecx & bit_AVX))
+        return 0;
+
+    // The OS has to save the ymm registers too, not just the CPU support them
+    uint32_t xcr0_lo, xcr0_hi;
+    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6)
+        return 0;
+
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+        return 0;
+    return (ebx & bit_AVX2) != 0;
+}
+#endif
+
+static int (*bytes_equal)(const char *, const char *, size_t) = bytes_equal_scalar;
+
+static void select_string_routines(void)
+{
+#if defined(__x86_64__)
+    bytes_equal = cpu_has_avx2() ? bytes_equal_avx2 : bytes_equal_sse2;
+#endif
+    DEBUG_LOG("string routines: %s",
+              bytes_equal == bytes_equal_scalar ? "scalar" : "simd");
+}
+
+uintptr_t compare_str(const char *str1, size_t len1, const char *str2, size_t len2)
+{
+    if (len1 != len2)
         return 0;
-    int result = strncmp(str1, str2, strlen(str1)) == 0;
-    DEBUG_LOG("string@compare(%s, %s): %s", str1, str2, result ? "true" : "false");
+    // Interned literals compared with themselves are the same pointer
+    if (str1 == str2)
+        return 1;
+    int result = bytes_equal(str1, str2, len1);
+    DEBUG_LOG("string@compare(%.*s, %.*s): %s", (int)len1, str1, (int)len2, str2, result ? "true" : "false");
     return result;
 }
 
@@ -175,13 +591,71 @@ void *new_zero(size_t bit_size)
     return ptr;
 }
 
+#ifdef LIBSW_BENCH
+/*
+ * Microbenchmark of print_uint against printf("%lu"), built instead of the
+ * normal entry point:
+ *   gcc -O2 -DLIBSW_BENCH runtime.c -o bench && ./bench > /dev/null
+ */
+#include <time.h>
+
+#define BENCH_NUMBERS 10000000
+
+static double seconds_since(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static uint64_t bench_number(uint64_t *state)
+{
+    // xorshift64, shifted down so every digit count shows up
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state >> (*state % 64);
+}
+
+int main(void)
+{
+    struct timespec start;
+    uint64_t state = 88172645463325252ULL;
+    out_init();
+    select_string_routines();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_NUMBERS; i++)
+    {
+        print_uint(bench_number(&state));
+        print_str("\n", 1);
+    }
+    flush_output();
+    double fast = seconds_since(&start);
+
+    state = 88172645463325252ULL;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < BENCH_NUMBERS; i++)
+        printf("%lu\n", (unsigned long)bench_number(&state));
+    fflush(stdout);
+    double slow = seconds_since(&start);
+
+    fprintf(stderr, "print_uint: %.3f s (%.1f ns/number)\n", fast, fast * 1e9 / BENCH_NUMBERS);
+    fprintf(stderr, "printf:     %.3f s (%.1f ns/number)\n", slow, slow * 1e9 / BENCH_NUMBERS);
+    return 0;
+}
+#else
 extern void sweet_main(void);
 
 int main(void)
 {
     DEBUG_LOG("libsw runtime v1.0");
     arena_init(&global_arena);
+    out_init();
+    select_string_routines();
     sweet_main();
     arena_cleanup(&global_arena);
+    in_cleanup();
     return 0;
 }
+#endif
@@ -9,14 +9,39 @@ import shutil
 from enum import Enum, auto
 
 from core.lexer import Lexer, LexerError
-from core.parser import Parser, ParserError
+from core.parser import Parser, ParserError, BuiltinTypes, string_bytes, stack_slots
+from core.peephole import Peephole
+from core.ir import IRBuilder
+from core.passes import PassManager, default_passes
+from core.x86 import X86Backend
+
+# Helpers libsw provides to generated code
+RUNTIME_SYMBOLS = ["print_int", "print_uint", "print_str", "compare_str", "copy_str", "stdin_getline", "new",
+                   "flush_output", "print_parts"]
+
+# Registers used to cache the top of the Sweet stack in the tos code generator
+TOS_REGS = ["rax", "rbx"]
 
 class CompileContext:
-    def __init__(self):
+    def __init__(self, opt_level=0, codegen="stack"):
+        self.opt_level = opt_level
+        self.codegen = codegen
+        self.peephole_removed = 0
+        self.pass_stats = []
+        # Registers holding the topmost stack values (deepest first), tos mode only
+        self.cached = []
+        # Counted loop induction variables living in registers, and the
+        # callee saved registers sweet_main has to preserve because of them
+        self.var_regs = {}
+        self.saved_regs = []
         self.stack_depth = 0
         self.stack_types = []
         self.known_externs = {}
         self.known_vars = []
+        # (label, size in bits, type, initial value) of every variable's static storage
+        self.storage = []
+        # (label, qwords) of tables the generated code fills in and hands to libsw
+        self.data_tables = []
         self.type_map = {
             "uint": 0,
             "char": 1,
@@ -31,24 +56,119 @@ class CompileContext:
         return "sw" + "".join(random.choices(string.ascii_letters + string.digits, k=10))
     
     def add_string(self, value):
-        label = self.new_label()
+        """Return the label of a string literal, interned by the bytes it ends up as."""
         if not hasattr(self, "strings"):
             self.strings = []
-        self.strings.append((label, value))
-        return label
+            self.string_labels = {}
+        encoded = string_bytes(value)
+        if encoded not in self.string_labels:
+            label = self.new_label()
+            self.string_labels[encoded] = label
+            self.strings.append((label, value))
+        return self.string_labels[encoded]
+
+    def tos_flush(self):
+        """Spill all cached top of stack registers to the machine stack."""
+        code = [f"    push {reg}" for reg in self.cached]
+        self.cached = []
+        return code
+
+    def tos_alloc(self, code):
+        """Pick a register for a new top of stack value, spilling the deepest cached one if all are taken."""
+        if len(self.cached) == len(TOS_REGS):
+            code.append(f"    push {self.cached.pop(0)}")
+        return next(reg for reg in TOS_REGS if reg not in self.cached)
+
+    def tos_pop(self, code, target=None, avoid=()):
+        """Take the top of stack value into a register, from the cache if possible."""
+        if target in self.cached:
+            raise Exception(f"Can't pop into cached register {target}")
+        if self.cached:
+            reg = self.cached.pop()
+            if target and target != reg:
+                code.append(f"    mov {target}, {reg}")
+                return target
+            return reg
+        if not target:
+            target = next(reg for reg in TOS_REGS if reg not in avoid)
+        code.append(f"    pop {target}")
+        return target
+
+def layout_strings(strings):
+    """
+    Lay the NUL terminated literals out so that one that is a suffix of
+    another points into its tail instead of taking its own copy. Returns
+    (bytes, {offset: [labels]}) for every literal that needs its own bytes.
+    """
+    hosts = []
+    for label, value in sorted(strings, key=lambda s: -len(string_bytes(s[1]))):
+        data = string_bytes(value) + b"\0"
+        host = next((h for h in hosts if h[0].endswith(data)), None)
+        if host:
+            host[1].setdefault(len(host[0]) - len(data), []).append(label)
+        else:
+            hosts.append((data, {0: [label]}))
+    return hosts
+
+def storage_bytes(size, btype):
+    """
+    Bytes of static storage for a variable of `size` bits. Char buffers get
+    room for a terminating NUL, and everything is rounded up to whole qwords
+    so variables stay 8 byte aligned and a qword store never runs into the
+    next one.
+    """
+    nbytes = (size + 7) // 8
+    if BuiltinTypes(btype) == BuiltinTypes.Char:
+        nbytes += 1
+    return max(8, (nbytes + 7) // 8 * 8)
+
+def gen_ir(ast, ctx):
+    fn = IRBuilder(ctx).lower(ast)
+    manager = PassManager(default_passes() if ctx.opt_level >= 1 else [])
+    manager.run(fn)
+    ctx.pass_stats = manager.report()
+    return fn
 
 def gen_asm(out, ast, ctx):
+    body = []
+    if ctx.codegen == "ir":
+        body = X86Backend(gen_ir(ast, ctx)).lower()
+    else:
+        for stmt in ast:
+            if type(stmt).__name__ == "Extern":
+                continue
+            body.append(f"    ; {type(stmt).__name__}")
+            body += stmt.compile(ctx)
+        # Cached values never reached the machine stack, so there's nothing to pop for them
+        leftover = stack_slots(ctx.stack_types) - len(ctx.cached)
+        ctx.cached = []
+        if leftover > 0:
+            body.append(f"    ; Cleanup stack ({leftover} leftover)")
+            body += ["    pop rax"] * leftover
+        if ctx.saved_regs:
+            # Keep the stack's alignment the same as without the saves
+            saved = sorted(ctx.saved_regs)
+            pad = ["    sub rsp, 8"] if len(saved) % 2 else []
+            body = [f"    push {reg}" for reg in saved] + pad + body
+            body += ["    add rsp, 8"] if pad else []
+            body += [f"    pop {reg}" for reg in reversed(saved)]
+        body.append("    ret")
+    if ctx.opt_level >= 1:
+        peephole = Peephole(body)
+        body = peephole.run()
+        ctx.peephole_removed = peephole.removed
+
+    # Only declare the runtime helpers the program ends up calling
+    called = {line.split()[1] for line in body if line.split()[:1] == ["call"]}
+
     out.write(";============================================================;\n")
     out.write("; Generated by Sweet v1.0 Compiler for x86_64 Linux (amd64)  ;\n")
     out.write(";============================================================;\n")
     out.write("section .text\n")
     out.write(";---------- External symbols defined by runtime (libsw) ----------;\n")
-    out.write("extern print_int\n")
-    out.write("extern print_str\n")
-    out.write("extern compare_int\n")
-    out.write("extern compare_str\n")
-    out.write("extern stdin_getline\n")
-    out.write("extern new\n")
+    for symbol in RUNTIME_SYMBOLS:
+        if symbol in called:
+            out.write(f"extern {symbol}\n")
     out.write(";---------- External symbols defined by user ----------;\n")
     for stmt in ast:
         if type(stmt).__name__ == "Extern":
@@ -56,42 +176,71 @@ def gen_asm(out, ast, ctx):
     out.write(";---------- Sweet Program Entry ----------;\n")
     out.write("global sweet_main\n")
     out.write("sweet_main:\n")
-    for stmt in ast:
-        if type(stmt).__name__ == "Extern":
-            continue
-        out.write(f"    ; {type(stmt).__name__}\n")
-        out.write("\n".join(stmt.compile(ctx)) + "\n")
-    if ctx.stack_depth > 0:
-        out.write(f"    ; Cleanup stack ({ctx.stack_depth} leftover)\n")
-        out.write("    " + "\n    ".join(["pop rax"] * ctx.stack_depth) + "\n")
-    out.write("    ret\n")
-    out.write("section .data\n")
+    out.write("\n".join(body) + "\n")
     if hasattr(ctx, "strings"):
+        # Nothing writes to literals, so they're read only. NASM can't mark a
+        # section SHF_MERGE|SHF_STRINGS, so merging is done here instead:
+        # every literal is emitted once and suffixes share their host's tail.
+        # Their lengths are constants in the code, the NUL is for C.
+        out.write("section .rodata\n")
         out.write(";---------- Strings defined by user ----------;\n")
-        for label, s in ctx.strings:
-            encoded = s.encode('utf-8').decode('unicode_escape').encode('latin1')
-            byte_vals = ', '.join(str(b) for b in encoded)
-            if byte_vals:
-                out.write(f"{label}: db {byte_vals}, 0\n")
+        for data, labels in layout_strings(ctx.strings):
+            offsets = sorted(labels)
+            for start, end in zip(offsets, offsets[1:] + [len(data)]):
+                for label in labels[start][:-1]:
+                    out.write(f"{label}:\n")
+                byte_vals = ", ".join(str(b) for b in data[start:end])
+                out.write(f"{labels[start][-1]}: db {byte_vals}\n")
+    initialized = [v for v in ctx.storage if v[3] is not None]
+    zeroed = [v for v in ctx.storage if v[3] is None]
+    if initialized or ctx.data_tables:
+        out.write("section .data\n")
+        if initialized:
+            out.write(";---------- Initialized variables defined by user ----------;\n")
+        out.write("align 8\n")
+        for label, size, btype, init in initialized:
+            nbytes = storage_bytes(size, btype)
+            if isinstance(init, bytes):
+                # Char buffers hold their text, with its length in the qword before it
+                out.write(f"    dq {len(init)}\n")
+                byte_vals = ", ".join(str(b) for b in init)
+                out.write(f"{label}: db {byte_vals}\n" if init else f"{label}:\n")
+                used = len(init)
             else:
-                out.write(f"{label}: db 0\n")
-    if hasattr(ctx, "vars"):
+                out.write(f"{label}: dq {init}\n")
+                used = 8
+            if nbytes > used:
+                out.write(f"    times {nbytes - used} db 0\n")
+        if ctx.data_tables:
+            out.write(";---------- Tables filled in at run time ----------;\n")
+            for label, values in ctx.data_tables:
+                out.write(f"{label}: dq {', '.join(str(v) for v in values)}\n")
+    if zeroed:
         out.write(";---------- Varibes defined by user ----------;\n")
-        out.write('section .bss\n')
-        for name, meta in ctx.vars.items():
-            label, size, btype, *rest = meta
-            out.write(f"{label}: resb {size}\n")
+        out.write("section .bss\n")
+        out.write("alignb 8\n")
+        for label, size, btype, init in zeroed:
+            if BuiltinTypes(btype) == BuiltinTypes.Char:
+                # The length before the buffer, zero for the empty string
+                out.write("    resb 8\n")
+            out.write(f"{label}: resb {storage_bytes(size, btype)}\n")
 
 def main():
     parser = argparse.ArgumentParser(description="Sweet v1.0 Compiler for x86_64 Linux (amd64)")
 
     parser.add_argument("source", help="Source file (.sw)")
     parser.add_argument("-o", "--output", help="Output executable name")
-    parser.add_argument("-of", "--output-format", choices=["bin", "asm", "ast", "lexer"], default="bin",
-                        help="Output format: bin (default), asm (stdout), ast (stdout), lexer (stdout)")
+    parser.add_argument("-of", "--output-format", choices=["bin", "asm", "ir", "ast", "lexer"], default="bin",
+                        help="Output format: bin (default), asm (stdout), ir (stdout), ast (stdout), lexer (stdout)")
     parser.add_argument("--cflags", default="", help="Additional C compiler flags")
     parser.add_argument("--ldflags", default="", help="Additional linker flags")
     parser.add_argument("--asflags", default="", help="Additional NASM flags")
+    parser.add_argument("-O", "--optimize", type=int, choices=[0, 1], default=0,
+                        help="Optimization level: 0 (default, none), 1 (peephole)")
+    parser.add_argument("--codegen", choices=["stack", "tos", "ir"], default="stack",
+                        help="Code generator: stack (default, every value lives on the machine stack), "
+                             "tos (cache the top of the stack in rax/rbx), "
+                             "ir (lower through the IR and its optimization passes)")
     parser.add_argument("-v", "--verbose", action="store_true", help="Verbose output")
     parser.add_argument("-r", "--run", action="store_true", help="Run the output binary after compilation, then remove it")
     parser.add_argument("-nc", "--no-clean", action="store_true", help="Do not remove the build directory after compilation")
@@ -104,7 +253,7 @@ def main():
         with open(input_file, "r") as f:
             src = f.read()
 
-        ctx = CompileContext()
+        ctx = CompileContext(opt_level=args.optimize, codegen=args.codegen)
         lexer = Lexer(src)
 
         if args.output_format == "lexer":
@@ -127,9 +276,22 @@ def main():
             print_ast(ast)
             return
 
+        if args.output_format == "ir":
+            fn = gen_ir(ast, ctx)
+            print("\n".join(fn.dump()))
+            if args.verbose:
+                for line in ctx.pass_stats:
+                    print(f"[+] {line}", file=sys.stderr)
+            return
+
         if args.output_format == "asm":
             out = sys.stdout
             gen_asm(out, ast, ctx)
+            if args.verbose:
+                for line in ctx.pass_stats:
+                    print(f"[+] {line}", file=sys.stderr)
+                if ctx.opt_level >= 1:
+                    print(f"[+] Peephole removed {ctx.peephole_removed} instructions", file=sys.stderr)
             return
 
         output_dir = ".build"
@@ -149,6 +311,10 @@ def main():
 
         if args.verbose:
             print(f"[+] Assembly written to {asm_file}")
+            for line in ctx.pass_stats:
+                print(f"[+] {line}")
+            if ctx.opt_level >= 1:
+                print(f"[+] Peephole removed {ctx.peephole_removed} instructions")
 
         asflags = args.asflags.split() if args.asflags else []
         subprocess.run(["nasm", "-f", "elf64", asm_file, "-o", obj_file] + asflags, check=True)